@@ -0,0 +1,359 @@
+/*
+simplefs_bench: a repeatable set of timings for the file system.
+
+Each run formats fresh images and measures format time, mount and scan
+time against the number of files, create/delete rate, and sequential and
+random throughput at several file and image sizes.  One result is written
+per measurement, as CSV or (with a .json output file) JSON, giving the wall
+time, operations per second, MB per second and the blocks the disk layer
+moved to and from the image file.  The random seed is fixed so runs can be
+compared between builds.  With -z the files are created compressed, and with
+-d deduplicated, so every file written from the same buffer shares its blocks.
+*/
+
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_CHUNK      65536
+#define BENCH_SMALL_IO   4096
+#define BENCH_RANDOM_OPS 2000
+#define BENCH_MOUNT_FILE (6*DISK_BLOCK_SIZE)   // one indirect block per file
+#define BENCH_MAX_SIZES  16
+
+struct result {
+	const char *name;
+	int image_blocks;
+	int file_bytes;
+	int nfiles;
+	long ops;
+	long bytes;
+	double seconds;
+	int reads;
+	int writes;
+};
+
+static const char *image = "bench.img";
+static int backend = DISK_BACKEND_PREAD;
+static FILE *out;
+static int json = 0;
+static int nresults = 0;
+static int create_flags = 0;
+
+static char *buffer;
+static int start_reads, start_writes;
+static double start_time;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static void timer_start()
+{
+	disk_counts(&start_reads,&start_writes);
+	start_time = now();
+}
+
+// Stop the clock and write one result line
+static void timer_stop( const char *name, int image_blocks, int file_bytes, int nfiles, long ops, long bytes )
+{
+	struct result r;
+	double mb;
+
+	r.seconds = now()-start_time;
+	disk_counts(&r.reads,&r.writes);
+	r.reads -= start_reads;
+	r.writes -= start_writes;
+	r.name = name;
+	r.image_blocks = image_blocks;
+	r.file_bytes = file_bytes;
+	r.nfiles = nfiles;
+	r.ops = ops;
+	r.bytes = bytes;
+
+	mb = r.bytes/1048576.0;
+	if(json) {
+		fprintf(out,"%s\n    {\"bench\": \"%s\", \"image_blocks\": %d, \"file_bytes\": %d, \"files\": %d, "
+			"\"ops\": %ld, \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+			"\"disk_reads\": %d, \"disk_writes\": %d}",
+			nresults ? "," : "",r.name,r.image_blocks,r.file_bytes,r.nfiles,
+			r.ops,r.seconds,r.ops/r.seconds,mb/r.seconds,r.reads,r.writes);
+	} else {
+		fprintf(out,"%s,%d,%d,%d,%ld,%.6f,%.1f,%.2f,%d,%d\n",
+			r.name,r.image_blocks,r.file_bytes,r.nfiles,
+			r.ops,r.seconds,r.ops/r.seconds,mb/r.seconds,r.reads,r.writes);
+	}
+	fflush(out);
+	nresults++;
+
+	fprintf(stderr,"%-12s %8d blocks %9d bytes %6d files: %9.1f ops/s %8.2f MB/s\n",
+		r.name,r.image_blocks,r.file_bytes,r.nfiles,r.ops/r.seconds,mb/r.seconds);
+}
+
+// Start from a fresh image, so format never asks before overwriting
+static void image_open( int blocks )
+{
+	unlink(image);
+	if(!disk_init_backend(image,blocks,backend)) {
+		fprintf(stderr,"couldn't initialize %s: %s\n",image,strerror(errno));
+		exit(1);
+	}
+}
+
+static void image_close()
+{
+	disk_close();
+	unlink(image);
+}
+
+// Write length bytes to the end of a file in chunks of chunk bytes
+static int write_file( int inumber, long length, int chunk )
+{
+	long offset = 0;
+	int n;
+
+	while(offset<length) {
+		n = length-offset<chunk ? length-offset : chunk;
+		if(fs_write(inumber,buffer,n,offset)!=n) return 0;
+		offset += n;
+	}
+	return 1;
+}
+
+static void bench_format( int blocks )
+{
+	image_open(blocks);
+	timer_start();
+	fs_format();
+	timer_stop("format",blocks,0,0,1,0);
+	image_close();
+
+	// a full format writes every block, so it is only timed on smaller images
+	if(blocks<=65536) {
+		image_open(blocks);
+		timer_start();
+		fs_format_full();
+		timer_stop("format_full",blocks,0,0,1,0);
+		image_close();
+	}
+}
+
+// Mount and scan time against the number of files on the image
+static void bench_mount( int blocks, int nfiles )
+{
+	int i, n;
+
+	image_open(blocks);
+	fs_format();
+	fs_mount();
+	for(i=0;i<nfiles;i++) {
+		n = fs_create();
+		if(n<0 || !write_file(n,BENCH_MOUNT_FILE,BENCH_MOUNT_FILE)) break;
+	}
+	nfiles = i;
+	fs_unmount();
+
+	timer_start();
+	fs_mount();
+	timer_stop("mount",blocks,BENCH_MOUNT_FILE,nfiles,1,0);
+
+	// the check walks every block pointer, as a mount after a crash on an image without a journal does
+	timer_start();
+	fs_check();
+	timer_stop("scan",blocks,BENCH_MOUNT_FILE,nfiles,1,0);
+
+	fs_unmount();
+	image_close();
+}
+
+static void bench_create_delete( int blocks, int nfiles )
+{
+	int *inodes = malloc(sizeof(int)*nfiles);
+	int i;
+
+	image_open(blocks);
+	fs_format();
+	fs_mount();
+
+	timer_start();
+	for(i=0;i<nfiles;i++) inodes[i] = fs_create();
+	fs_sync();
+	timer_stop("create",blocks,0,nfiles,nfiles,0);
+
+	timer_start();
+	for(i=0;i<nfiles;i++) fs_delete(inodes[i]);
+	fs_sync();
+	timer_stop("delete",blocks,0,nfiles,nfiles,0);
+
+	fs_unmount();
+	image_close();
+	free(inodes);
+}
+
+// Sequential and random throughput for files of one size, using about a quarter of the image
+static void bench_files( int blocks, int size )
+{
+	long total = (long)blocks*DISK_BLOCK_SIZE/4;
+	int nfiles = total/size>0 ? total/size : 1;
+	int *inodes;
+	long offset;
+	int i, n;
+
+	if(nfiles>1024) nfiles = 1024;
+	inodes = malloc(sizeof(int)*nfiles);
+
+	image_open(blocks);
+	fs_format();
+	fs_mount();
+
+	timer_start();
+	for(i=0;i<nfiles;i++) {
+		inodes[i] = fs_create_mode(create_flags);
+		if(inodes[i]<0 || !write_file(inodes[i],size,BENCH_CHUNK)) break;
+	}
+	fs_sync();
+	nfiles = i;
+	timer_stop("seq_write",blocks,size,nfiles,(long)nfiles*((size+BENCH_CHUNK-1)/BENCH_CHUNK),(long)nfiles*size);
+
+	timer_start();
+	for(i=0;i<nfiles;i++) {
+		for(offset=0;offset<size;offset+=n) {
+			n = fs_read(inodes[i],buffer,BENCH_CHUNK,offset);
+			if(n<=0) break;
+		}
+	}
+	timer_stop("seq_read",blocks,size,nfiles,(long)nfiles*((size+BENCH_CHUNK-1)/BENCH_CHUNK),(long)nfiles*size);
+
+	// small reads at unaligned offsets spread over all the files
+	srand(1);
+	timer_start();
+	for(i=0;i<BENCH_RANDOM_OPS;i++) {
+		n = inodes[rand()%nfiles];
+		fs_read(n,buffer,BENCH_SMALL_IO,rand()%size);
+	}
+	timer_stop("rand_read",blocks,size,nfiles,BENCH_RANDOM_OPS,(long)BENCH_RANDOM_OPS*BENCH_SMALL_IO);
+
+	// small overwrites at unaligned offsets inside the files, which leave their size and blocks alone
+	srand(2);
+	timer_start();
+	for(i=0;i<BENCH_RANDOM_OPS;i++) {
+		n = inodes[rand()%nfiles];
+		fs_write(n,buffer,BENCH_SMALL_IO,size>BENCH_SMALL_IO ? rand()%(size-BENCH_SMALL_IO) : 0);
+	}
+	fs_sync();
+	timer_stop("rand_write",blocks,size,nfiles,BENCH_RANDOM_OPS,(long)BENCH_RANDOM_OPS*BENCH_SMALL_IO);
+
+	// small appends to a file of this size
+	n = fs_create_mode(create_flags);
+	timer_start();
+	write_file(n,size,BENCH_SMALL_IO);
+	fs_sync();
+	timer_stop("append",blocks,size,1,(size+BENCH_SMALL_IO-1)/BENCH_SMALL_IO,size);
+
+	fs_unmount();
+	image_close();
+	free(inodes);
+}
+
+// Parse a comma separated list of sizes
+static int parse_sizes( const char *arg, int *sizes )
+{
+	int n = 0;
+	char *end;
+
+	while(*arg && n<BENCH_MAX_SIZES) {
+		sizes[n++] = strtol(arg,&end,10);
+		if(*end=='k' || *end=='K') { sizes[n-1] *= 1024; end++; }
+		if(*end=='m' || *end=='M') { sizes[n-1] *= 1048576; end++; }
+		if(*end!=',') break;
+		arg = end+1;
+	}
+	return n;
+}
+
+int main( int argc, char *argv[] )
+{
+	int image_sizes[BENCH_MAX_SIZES] = { 8192, 65536 };
+	int file_sizes[BENCH_MAX_SIZES] = { 16384, 262144, 4194304 };
+	int mount_files[BENCH_MAX_SIZES] = { 100, 1000, 4000 };
+	int nimage = 2, nfile = 3, nmount = 3;
+	const char *output = "bench.csv";
+	const char *name = "pread";
+	int opt, i, j;
+
+	while((opt=getopt(argc,argv,"o:i:b:s:f:m:zd"))!=-1) {
+		switch(opt) {
+			case 'o': output = optarg; break;
+			case 'i': image = optarg; break;
+			case 'b':
+				name = optarg;
+				if(!strcmp(optarg,"mmap")) backend = DISK_BACKEND_MMAP;
+				else if(!strcmp(optarg,"uring")) backend = DISK_BACKEND_URING;
+				else if(strcmp(optarg,"pread")) goto usage;
+				break;
+			case 's': nimage = parse_sizes(optarg,image_sizes); break;
+			case 'f': nfile = parse_sizes(optarg,file_sizes); break;
+			case 'm': nmount = parse_sizes(optarg,mount_files); break;
+			case 'z': create_flags = FS_CREATE_COMPRESSED; break;
+			case 'd': create_flags = FS_CREATE_DEDUP; break;
+			default: goto usage;
+		}
+	}
+
+	out = fopen(output,"w");
+	if(!out) {
+		fprintf(stderr,"couldn't open %s: %s\n",output,strerror(errno));
+		return 1;
+	}
+	json = strlen(output)>5 && !strcmp(output+strlen(output)-5,".json");
+	// all-zero blocks are kept as holes, so the data written must not be zeros.  Compressed files get
+	// log-like text, which packs about two to one; the others get data that does not pack at all.
+	buffer = malloc(BENCH_CHUNK+128);
+	srand(0);
+	if(create_flags & FS_CREATE_COMPRESSED) {
+		for(i=0;i<BENCH_CHUNK;) i += sprintf(buffer+i,"%06d INFO request id=%d status=%d bytes=%d\n",i,rand()%100000,200+rand()%4*100,rand()%10000);
+	} else {
+		for(i=0;i<BENCH_CHUNK;i++) buffer[i] = rand();
+	}
+
+	if(json) {
+		fprintf(out,"{\n  \"backend\": \"%s\",\n  \"results\": [",name);
+	} else {
+		fprintf(out,"bench,image_blocks,file_bytes,files,ops,seconds,ops_per_sec,mb_per_sec,disk_reads,disk_writes\n");
+	}
+
+	// the file system and disk layer report to stdout, so results only go to the output file
+	fprintf(stderr,"simplefs_bench: %s backend, writing %s\n",name,output);
+	for(i=0;i<nimage;i++) {
+		bench_format(image_sizes[i]);
+		for(j=0;j<nmount;j++) {
+			// each file takes seven blocks; leave room for the metadata
+			if((long)mount_files[j]*7<image_sizes[i]/2) bench_mount(image_sizes[i],mount_files[j]);
+		}
+		bench_create_delete(image_sizes[i],image_sizes[i]/10);
+		for(j=0;j<nfile;j++) {
+			if((long)file_sizes[j]<(long)image_sizes[i]*DISK_BLOCK_SIZE/4) bench_files(image_sizes[i],file_sizes[j]);
+		}
+	}
+
+	if(json) fprintf(out,"\n  ]\n}\n");
+	fclose(out);
+	free(buffer);
+	return 0;
+
+usage:
+	fprintf(stderr,"use: %s [-o out.csv|out.json] [-i image] [-b pread|mmap|uring]\n",argv[0]);
+	fprintf(stderr,"       [-s image blocks,...] [-f file sizes,...] [-m mount file counts,...] [-z|-d]\n");
+	fprintf(stderr,"       -z creates the files compressed and writes text to them\n");
+	fprintf(stderr,"       -d creates the files deduplicated\n");
+	return 1;
+}
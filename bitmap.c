@@ -0,0 +1,241 @@
+/*
+
+csci5103_project3
+
+File Systems
+
+Bryan Baker - bake1358@umn.edu
+Alice Anderegg - and08613@umn.edu
+Hailin Archer - deak0007@umn.edu
+
+*/
+
+#include "bitmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+// Create a bitmap with every entry free
+int bitmap_init( struct bitmap *b, int nbits )
+{
+	int i;
+
+	b->nbits = nbits;
+	b->nwords = (nbits + 63) / 64;
+	b->nsummary = (b->nwords + 63) / 64;
+	b->cursor = 0;
+	b->words = (uint64_t*) calloc(b->nwords ? b->nwords : 1, sizeof(uint64_t));
+	b->summary = (uint64_t*) calloc(b->nsummary ? b->nsummary : 1, sizeof(uint64_t));
+	if ( !b->words || !b->summary ) {
+		bitmap_free(b);
+		return 0;
+	}
+
+	// entries past the end are permanently busy so they are never handed out
+	for ( i = nbits; i < b->nwords * 64; i++ ) {
+		bitmap_set(b, i);
+	}
+
+	return 1;
+}
+
+void bitmap_free( struct bitmap *b )
+{
+	free(b->words);
+	free(b->summary);
+	b->words = NULL;
+	b->summary = NULL;
+	b->nbits = b->nwords = b->nsummary = 0;
+}
+
+// Recompute the summary level after the words have been filled in from elsewhere
+void bitmap_rebuild( struct bitmap *b )
+{
+	int i;
+
+	memset(b->summary, 0, b->nsummary * sizeof(uint64_t));
+	for ( i = b->nbits; i < b->nwords * 64; i++ ) {
+		b->words[i / 64] |= (uint64_t)1 << (i % 64);
+	}
+	for ( i = 0; i < b->nwords; i++ ) {
+		if ( b->words[i] == ~(uint64_t)0 ) {
+			b->summary[i / 64] |= (uint64_t)1 << (i % 64);
+		}
+	}
+	b->cursor = 0;
+}
+
+int bitmap_test( struct bitmap *b, int bit )
+{
+	return (b->words[bit / 64] >> (bit % 64)) & 1;
+}
+
+void bitmap_set( struct bitmap *b, int bit )
+{
+	int w = bit / 64;
+
+	b->words[w] |= (uint64_t)1 << (bit % 64);
+	if ( b->words[w] == ~(uint64_t)0 ) {
+		b->summary[w / 64] |= (uint64_t)1 << (w % 64);
+	}
+}
+
+void bitmap_clear( struct bitmap *b, int bit )
+{
+	int w = bit / 64;
+
+	b->words[w] &= ~((uint64_t)1 << (bit % 64));
+	b->summary[w / 64] &= ~((uint64_t)1 << (w % 64));
+}
+
+void bitmap_set_range( struct bitmap *b, int start, int n )
+{
+	int i;
+
+	for ( i = start; i < start + n; i++ ) {
+		bitmap_set(b, i);
+	}
+}
+
+// Find a word with a free entry at or after word w and before word end, or -1
+static int find_word( struct bitmap *b, int w, int end )
+{
+	int s = w / 64;
+	uint64_t open;
+
+	if ( w >= end ) {
+		return -1;
+	}
+
+	// words in the first summary word that come before w are masked off
+	open = ~b->summary[s] & (~(uint64_t)0 << (w % 64));
+	while ( 1 ) {
+		if ( open ) {
+			w = (s * 64) + __builtin_ctzll(open);
+			return w < end ? w : -1;
+		}
+		if ( ++s * 64 >= end ) {
+			return -1;
+		}
+		open = ~b->summary[s];
+	}
+}
+
+// Find the first free entry at or after bit and before last, or -1.
+// Nothing past the word holding last is looked at.
+static int find_from( struct bitmap *b, int bit, int last )
+{
+	int w = bit / 64;
+	uint64_t open;
+
+	if ( bit >= last ) {
+		return -1;
+	}
+
+	open = ~b->words[w] & (~(uint64_t)0 << (bit % 64));
+	if ( !open ) {
+		w = find_word(b, w + 1, (last + 63) / 64);
+		if ( w < 0 ) {
+			return -1;
+		}
+		open = ~b->words[w];
+	}
+	bit = (w * 64) + __builtin_ctzll(open);
+	return bit < last ? bit : -1;
+}
+
+// Count the free entries starting at bit, stopping at max
+static int run_length( struct bitmap *b, int bit, int max )
+{
+	int len = 0;
+	int off;
+	uint64_t open;
+
+	while ( len < max && bit < b->nbits ) {
+		off = bit % 64;
+		open = ~b->words[bit / 64] >> off;
+		if ( open == (~(uint64_t)0 >> off) ) {
+			// the rest of this word is free
+			len += 64 - off;
+			bit += 64 - off;
+			continue;
+		}
+		len += __builtin_ctzll(~open);
+		break;
+	}
+	return len < max ? len : max;
+}
+
+// Move the search cursor back to bit if it is past it.  A bitmap that is
+// rewound on every clear always hands out its lowest free entry.
+void bitmap_rewind( struct bitmap *b, int bit )
+{
+	if ( bit < b->cursor ) {
+		b->cursor = bit;
+	}
+}
+
+// Next-fit search for a free entry, starting at the last allocation
+int bitmap_find_free( struct bitmap *b )
+{
+	int bit;
+
+	bit = find_from(b, b->cursor, b->nbits);
+	if ( bit < 0 ) {
+		bit = find_from(b, 0, b->nbits);
+	}
+	if ( bit < 0 ) {
+		return -1;
+	}
+
+	b->cursor = bit;
+	return bit;
+}
+
+// Next-fit search for a run of want free entries from first up to last,
+// resuming at a search cursor of the caller's own.  If no run is long enough
+// within BITMAP_RUN_TRIES candidates, the longest one seen is returned.
+// The run length is stored in got, and the run never crosses last.
+int bitmap_find_run_in( struct bitmap *b, int first, int last, int *cursor, int want, int *got )
+{
+	int bit, len, tries;
+	int best = -1;
+	int bestlen = 0;
+	int start = *cursor >= first && *cursor < last ? *cursor : first;
+	int pos = start;
+	bool wrapped = false;
+
+	for ( tries = 0; tries < BITMAP_RUN_TRIES; tries++ ) {
+		bit = find_from(b, pos, last);
+		if ( bit < 0 || (wrapped && bit >= start) ) {
+			if ( wrapped ) {
+				break;
+			}
+			wrapped = true;
+			bit = find_from(b, first, last);
+			if ( bit < 0 || bit >= start ) {
+				break;
+			}
+		}
+
+		len = run_length(b, bit, want < last - bit ? want : last - bit);
+		if ( len > bestlen ) {
+			best = bit;
+			bestlen = len;
+			if ( len == want ) {
+				break;
+			}
+		}
+		pos = bit + len;
+	}
+
+	if ( best >= 0 ) {
+		*cursor = best + bestlen;
+		if ( *cursor >= last ) {
+			*cursor = first;
+		}
+	}
+	*got = bestlen;
+	return best;
+}
@@ -0,0 +1,35 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+
+/*
+A bit-packed allocation bitmap.  A set bit marks a busy entry.  The summary
+level keeps one bit per 64-bit word, set when that word is completely busy,
+so a search for a free entry skips 4096 busy entries per summary bit.
+*/
+
+// number of candidate runs bitmap_find_run_in looks at before settling
+#define BITMAP_RUN_TRIES 64
+
+struct bitmap {
+	int nbits;
+	int nwords;
+	int nsummary;
+	int cursor;
+	uint64_t *words;
+	uint64_t *summary;
+};
+
+int  bitmap_init( struct bitmap *b, int nbits );
+void bitmap_free( struct bitmap *b );
+void bitmap_rebuild( struct bitmap *b );
+int  bitmap_test( struct bitmap *b, int bit );
+void bitmap_set( struct bitmap *b, int bit );
+void bitmap_clear( struct bitmap *b, int bit );
+void bitmap_set_range( struct bitmap *b, int start, int n );
+void bitmap_rewind( struct bitmap *b, int bit );
+int  bitmap_find_free( struct bitmap *b );
+int  bitmap_find_run_in( struct bitmap *b, int first, int last, int *cursor, int want, int *got );
+
+#endif
@@ -1,90 +1,1072 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <errno.h>
-#include <string.h>
-
-#include "disk.h"
-
-#define DISK_MAGIC 0xdeadbeef
-
-static FILE *diskfile;
-static int nblocks=0;
-static int nreads=0;
-static int nwrites=0;
-
-int disk_init( const char *filename, int n )
-{
-	diskfile = fopen(filename,"r+");
-	if(!diskfile) diskfile = fopen(filename,"w+");
-	if(!diskfile) return 0;
-
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
-
-	nblocks = n;
-	nreads = 0;
-	nwrites = 0;
-
-	return 1;
-}
-
-int disk_size()
-{
-	return nblocks;
-}
-
-static void sanity_check( int blocknum, const void *data )
-{
-	if(blocknum<0) {
-		printf("ERROR: blocknum (%d) is negative!\n",blocknum);
-		abort();
-	}
-
-	if(blocknum>=nblocks) {
-		printf("ERROR: blocknum (%d) is too big!\n",blocknum);
-		abort();
-	}
-
-	if(!data) {
-		printf("ERROR: null data pointer!\n");
-		abort();
-	}
-}
-
-void disk_read( int blocknum, char *data )
-{
-	sanity_check(blocknum,data);
-
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
-
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
-	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
-	}
-}
-
-void disk_write( int blocknum, const char *data )
-{
-	sanity_check(blocknum,data);
-
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
-
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
-	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
-	}
-}
-
-void disk_close()
-{
-	if(diskfile) {
-		printf("%d disk block reads\n",nreads);
-		printf("%d disk block writes\n",nwrites);
-		fclose(diskfile);
-		diskfile = 0;
-	}
-}
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include "disk.h"
+#include "uring.h"
+
+#define DISK_MAGIC 0xdeadbeef
+#define TRACE_BUFFER 4096   // trace records gathered before they are written out
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static int diskfd=-1;
+static char *diskmap=0;
+static int backend=DISK_BACKEND_PREAD;
+static int nblocks=0;
+static int nreads=0;
+static int nwrites=0;
+
+/*
+One recursive lock covers the buffer cache and the io_uring queue, so the
+disk interface may be called from several threads.  Plain preadv/pwritev
+transfers into caller buffers run outside it, which lets concurrent readers
+keep the device busy.  nreads and nwrites are updated atomically for that.
+*/
+
+static pthread_mutex_t disk_lock=PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+/*
+Statistics.  Every transfer and cache lookup is also counted against the
+class the calling thread last named with disk_class, both in the global
+stats and in counters private to the thread, so a caller can tell how much
+traffic one of its own operations caused.  Write-backs of evicted blocks are
+charged to whoever caused the eviction.  nreads and nwrites keep counting
+from disk_init and are not touched by disk_stats_reset.
+*/
+
+static struct disk_stats stats;
+static __thread int io_class=DISK_CLASS_META;
+static __thread struct disk_class_stats thread_stats[DISK_CLASSES];
+
+/*
+Tracing.  While a trace is open, every call that names blocks appends records
+to a buffer that is written to the trace file when it fills.  The records of
+one call are added under trace_lock in one go, so calls from different threads
+never interleave.  Each record carries the operation the calling thread named
+with disk_caller.
+*/
+
+static int trace_fd=-1;
+static long trace_start;
+static struct disk_trace_record *trace_buf=0;
+static int trace_n=0;
+static pthread_mutex_t trace_lock=PTHREAD_MUTEX_INITIALIZER;
+static __thread int trace_caller=DISK_TRACE_NONE;
+
+/*
+The buffer cache sits between the disk_read/disk_write interface and the
+image file.  Blocks are kept on a doubly linked LRU list (most recently used
+at the head) and are found through a chained hash table keyed on block
+number.  Writes only dirty the cached copy; the data reaches the image when
+the block is evicted, on disk_sync, or at disk_close.  nreads and nwrites
+count the transfers that actually hit the image file.
+*/
+
+struct cache_entry {
+	int blocknum;
+	int dirty;
+	struct cache_entry *prev;
+	struct cache_entry *next;
+	struct cache_entry *hnext;
+	char data[DISK_BLOCK_SIZE];
+};
+
+static struct cache_entry *cache=0;
+static struct cache_entry **cache_hash=0;
+static struct cache_entry lru;
+static int cache_capacity=0;
+static int cache_configured=DISK_CACHE_DEFAULT;
+static int cache_hashmask=0;
+static int cache_hits=0;
+static int cache_misses=0;
+
+/*
+The io_uring backend keeps up to queue_depth vectored requests in flight.
+Each request covers at most DISK_URING_RUN adjacent blocks, so one long run
+is split into several requests that the device can work on at once.  The
+buffers named in a submitted request must stay untouched until
+disk_complete returns.
+*/
+
+struct disk_request {
+	int write;
+	int blocknum;
+	int nblocks;
+	struct iovec iov[DISK_URING_RUN];
+	struct disk_request *next;
+};
+
+static struct uring ring;
+static struct disk_request *requests=0;
+static struct disk_request *free_requests=0;
+static int queue_depth=DISK_QUEUE_DEPTH;
+static int inflight=0;
+
+static int cache_setup( int n );
+static int uring_setup( int depth );
+
+int disk_init( const char *filename, int n )
+{
+	return disk_init_backend(filename,n,DISK_BACKEND_PREAD);
+}
+
+/*
+The pread backend moves blocks with preadv/pwritev behind the buffer cache.
+The mmap backend maps the whole image and copies blocks in and out of the
+mapping; the kernel page cache takes the place of the buffer cache, and
+disk_block_ptr can hand out read-only views of blocks without any copy.
+*/
+
+int disk_init_backend( const char *filename, int n, int which )
+{
+	diskfd = open(filename,O_RDWR|O_CREAT,0666);
+	if(diskfd<0) return 0;
+
+	ftruncate(diskfd,(off_t)n*DISK_BLOCK_SIZE);
+
+	nblocks = n;
+	nreads = 0;
+	nwrites = 0;
+	backend = which;
+
+	if(backend==DISK_BACKEND_URING && !uring_setup(queue_depth)) {
+		printf("io_uring is not available, using synchronous I/O\n");
+		backend = DISK_BACKEND_PREAD;
+	}
+
+	if(backend==DISK_BACKEND_MMAP) {
+		diskmap = mmap(0,(size_t)n*DISK_BLOCK_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED,diskfd,0);
+		if(diskmap==MAP_FAILED) {
+			diskmap = 0;
+			close(diskfd);
+			diskfd = -1;
+			return 0;
+		}
+	}
+
+	if(!cache_setup(diskmap ? 0 : cache_configured)) {
+		if(diskmap) munmap(diskmap,(size_t)nblocks*DISK_BLOCK_SIZE);
+		diskmap = 0;
+		if(backend==DISK_BACKEND_URING) {
+			uring_exit(&ring);
+			free(requests);
+			requests = 0;
+			free_requests = 0;
+		}
+		close(diskfd);
+		diskfd = -1;
+		return 0;
+	}
+
+	return 1;
+}
+
+void disk_queue_depth( int depth )
+{
+	if(depth>0) queue_depth = depth;
+}
+
+int disk_size()
+{
+	return nblocks;
+}
+
+static void sanity_check( int blocknum, const void *data )
+{
+	if(blocknum<0) {
+		printf("ERROR: blocknum (%d) is negative!\n",blocknum);
+		abort();
+	}
+
+	if(blocknum>=nblocks) {
+		printf("ERROR: blocknum (%d) is too big!\n",blocknum);
+		abort();
+	}
+
+	if(!data) {
+		printf("ERROR: null data pointer!\n");
+		abort();
+	}
+}
+
+// Copy a list of buffers to or from the mapped image at offset
+static void map_transfer( int write, off_t offset, struct iovec *iov, int iovcnt )
+{
+	int i;
+
+	for(i=0;i<iovcnt;i++) {
+		if(write) {
+			memcpy(diskmap+offset,iov[i].iov_base,iov[i].iov_len);
+		} else {
+			memcpy(iov[i].iov_base,diskmap+offset,iov[i].iov_len);
+		}
+		offset += iov[i].iov_len;
+	}
+}
+
+// Transfer a list of buffers to or from the image file at offset,
+// retrying until a short read or write has been completed.
+static void file_transfer( int write, off_t offset, struct iovec *iov, int iovcnt )
+{
+	ssize_t result;
+
+	while(iovcnt>0) {
+		if(write) {
+			result = pwritev(diskfd,iov,iovcnt,offset);
+		} else {
+			result = preadv(diskfd,iov,iovcnt,offset);
+		}
+		if(result<0 && errno==EINTR) continue;
+		if(result<=0) {
+			printf("ERROR: couldn't access simulated disk: %s\n",result<0 ? strerror(errno) : "unexpected end of file");
+			abort();
+		}
+
+		offset += result;
+		while(iovcnt>0 && (size_t)result>=iov->iov_len) {
+			result -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt>0) {
+			iov->iov_base = (char*)iov->iov_base+result;
+			iov->iov_len -= result;
+		}
+	}
+}
+
+static void count_transfer( int write, int n )
+{
+	__atomic_add_fetch(write ? &nwrites : &nreads,n,__ATOMIC_RELAXED);
+	if(write) {
+		__atomic_add_fetch(&stats.classes[io_class].writes,n,__ATOMIC_RELAXED);
+		thread_stats[io_class].writes += n;
+	} else {
+		__atomic_add_fetch(&stats.classes[io_class].reads,n,__ATOMIC_RELAXED);
+		thread_stats[io_class].reads += n;
+	}
+}
+
+// Count a buffer cache lookup.  The caller holds disk_lock.
+static void count_lookup( int hit )
+{
+	if(hit) {
+		cache_hits++;
+		__atomic_add_fetch(&stats.classes[io_class].hits,1,__ATOMIC_RELAXED);
+		thread_stats[io_class].hits++;
+	} else {
+		cache_misses++;
+		__atomic_add_fetch(&stats.classes[io_class].misses,1,__ATOMIC_RELAXED);
+		thread_stats[io_class].misses++;
+	}
+}
+
+// Transfer a list of buffers to or from consecutive blocks starting at blocknum
+static void raw_transfer( int write, int blocknum, struct iovec *iov, int iovcnt )
+{
+	off_t offset = (off_t)blocknum*DISK_BLOCK_SIZE;
+	int nblocks = 0;
+	int i;
+
+	for(i=0;i<iovcnt;i++) nblocks += iov[i].iov_len/DISK_BLOCK_SIZE;
+
+	// synchronous transfers never overtake requests still in flight
+	if(inflight) disk_complete();
+
+	if(diskmap) {
+		map_transfer(write,offset,iov,iovcnt);
+	} else {
+		file_transfer(write,offset,iov,iovcnt);
+	}
+
+	count_transfer(write,nblocks);
+}
+
+static void raw_read( int blocknum, char *data )
+{
+	struct iovec iov = { data, DISK_BLOCK_SIZE };
+	raw_transfer(0,blocknum,&iov,1);
+}
+
+static void raw_write( int blocknum, const char *data )
+{
+	struct iovec iov = { (char*)data, DISK_BLOCK_SIZE };
+	raw_transfer(1,blocknum,&iov,1);
+}
+
+// Write out the buffered trace records.  The caller holds trace_lock.
+static void trace_flush()
+{
+	char *p = (char*)trace_buf;
+	size_t left = trace_n*sizeof(*trace_buf);
+	ssize_t result;
+
+	while(left>0) {
+		result = write(trace_fd,p,left);
+		if(result<0 && errno==EINTR) continue;
+		if(result<0) {
+			printf("ERROR: couldn't write block trace: %s\n",strerror(errno));
+			close(trace_fd);
+			__atomic_store_n(&trace_fd,-1,__ATOMIC_RELAXED);
+			break;
+		}
+		p += result;
+		left -= result;
+	}
+	trace_n = 0;
+}
+
+// Add one block to the call being recorded, extending the last record when the block follows it.
+// more is set for every block after the first of a call.  The caller holds trace_lock.
+static void trace_add( int op, int blocknum, int more, uint64_t time )
+{
+	struct disk_trace_record *r;
+
+	if(more && trace_n>0) {
+		r = &trace_buf[trace_n-1];
+		if(r->blocknum+r->nblocks==blocknum && r->nblocks<UINT16_MAX) {
+			r->nblocks++;
+			return;
+		}
+	}
+
+	if(trace_n==TRACE_BUFFER) {
+		trace_flush();
+		if(trace_fd<0) return;
+	}
+	r = &trace_buf[trace_n++];
+	r->time = time;
+	r->blocknum = blocknum;
+	r->nblocks = 1;
+	r->op = op | (more ? DISK_TRACE_MORE : 0);
+	r->caller = trace_caller;
+}
+
+// Record a call naming n blocks, taken from either an I/O list or a list of block numbers,
+// or when both are null a single run of n blocks from blocknum.
+static void trace_call( int op, const struct disk_io *io, const int *blocknums, int blocknum, int n )
+{
+	uint64_t time;
+	int i;
+
+	if(__atomic_load_n(&trace_fd,__ATOMIC_RELAXED)<0) return;
+
+	pthread_mutex_lock(&trace_lock);
+	time = stats_now()-trace_start;
+	for(i=0;i<n && trace_fd>=0;i++) {
+		if(io) {
+			trace_add(op,io[i].blocknum,i>0,time);
+		} else if(blocknums) {
+			trace_add(op,blocknums[i],i>0,time);
+		} else {
+			trace_add(op,blocknum+i,i>0,time);
+		}
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void lru_unlink( struct cache_entry *e )
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static void lru_push_front( struct cache_entry *e )
+{
+	e->next = lru.next;
+	e->prev = &lru;
+	lru.next->prev = e;
+	lru.next = e;
+}
+
+static void hash_remove( struct cache_entry *e )
+{
+	struct cache_entry **p = &cache_hash[e->blocknum & cache_hashmask];
+
+	while(*p && *p!=e) p = &(*p)->hnext;
+	if(*p) *p = e->hnext;
+	e->hnext = 0;
+}
+
+static struct cache_entry * cache_lookup( int blocknum )
+{
+	struct cache_entry *e;
+
+	if(!cache_capacity) return 0;
+
+	for(e=cache_hash[blocknum & cache_hashmask];e;e=e->hnext) {
+		if(e->blocknum==blocknum) return e;
+	}
+	return 0;
+}
+
+// Take the least recently used entry, writing it back if it is dirty,
+// and rebind it to blocknum.  The caller fills in the data.
+static struct cache_entry * cache_claim( int blocknum )
+{
+	struct cache_entry *e = lru.prev;
+
+	if(e->blocknum>=0) {
+		if(e->dirty) raw_write(e->blocknum,e->data);
+		hash_remove(e);
+	}
+
+	e->blocknum = blocknum;
+	e->dirty = 0;
+	e->hnext = cache_hash[blocknum & cache_hashmask];
+	cache_hash[blocknum & cache_hashmask] = e;
+
+	return e;
+}
+
+static void cache_touch( struct cache_entry *e )
+{
+	lru_unlink(e);
+	lru_push_front(e);
+}
+
+void disk_sync()
+{
+	struct cache_entry *e;
+
+	trace_call(DISK_TRACE_SYNC,0,0,0,1);
+
+	if(diskmap) {
+		msync(diskmap,(size_t)nblocks*DISK_BLOCK_SIZE,MS_SYNC);
+		return;
+	}
+
+	// writes submitted through disk_submit_writev are waited for, so they are synced as well
+	pthread_mutex_lock(&disk_lock);
+	if(inflight) disk_complete();
+	for(e=lru.next;cache && e!=&lru;e=e->next) {
+		if(e->blocknum>=0 && e->dirty) {
+			raw_write(e->blocknum,e->data);
+			e->dirty = 0;
+		}
+	}
+
+	// everything written so far reaches the media before anything written after
+	fdatasync(diskfd);
+	pthread_mutex_unlock(&disk_lock);
+}
+
+int disk_cache_size( int n )
+{
+	int result;
+
+	if(n<0) return 0;
+
+	cache_configured = n;
+	if(diskmap) return 1;
+
+	pthread_mutex_lock(&disk_lock);
+	result = cache_setup(n);
+	pthread_mutex_unlock(&disk_lock);
+
+	return result;
+}
+
+static int cache_setup( int n )
+{
+	int i;
+
+	if(cache) {
+		disk_sync();
+		free(cache);
+		free(cache_hash);
+		cache = 0;
+		cache_hash = 0;
+	}
+
+	cache_capacity = n;
+	lru.next = lru.prev = &lru;
+	if(!n) return 1;
+
+	for(cache_hashmask=1;cache_hashmask<n;cache_hashmask<<=1) {}
+
+	cache = malloc(sizeof(*cache)*n);
+	cache_hash = calloc(cache_hashmask,sizeof(*cache_hash));
+	if(!cache || !cache_hash) {
+		free(cache);
+		free(cache_hash);
+		cache = 0;
+		cache_hash = 0;
+		cache_capacity = 0;
+		return 0;
+	}
+	cache_hashmask--;
+
+	for(i=0;i<n;i++) {
+		cache[i].blocknum = -1;
+		cache[i].dirty = 0;
+		cache[i].hnext = 0;
+		lru_push_front(&cache[i]);
+	}
+
+	return 1;
+}
+
+void disk_read( int blocknum, char *data )
+{
+	struct cache_entry *e;
+	long start = stats_now();
+
+	sanity_check(blocknum,data);
+	trace_call(DISK_TRACE_READ,0,0,blocknum,1);
+
+	pthread_mutex_lock(&disk_lock);
+	if(!cache_capacity) {
+		raw_read(blocknum,data);
+	} else {
+		e = cache_lookup(blocknum);
+		count_lookup(e!=0);
+		if(!e) {
+			e = cache_claim(blocknum);
+			raw_read(blocknum,e->data);
+		}
+		cache_touch(e);
+		memcpy(data,e->data,DISK_BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&disk_lock);
+
+	stats_record(&stats.read_latency,stats_now()-start);
+}
+
+void disk_write( int blocknum, const char *data )
+{
+	struct cache_entry *e;
+	long start = stats_now();
+
+	sanity_check(blocknum,data);
+	trace_call(DISK_TRACE_WRITE,0,0,blocknum,1);
+
+	pthread_mutex_lock(&disk_lock);
+	if(!cache_capacity) {
+		raw_write(blocknum,data);
+	} else {
+		// whole-block writes never need the old contents, so a miss just
+		// claims an entry without reading the image
+		e = cache_lookup(blocknum);
+		if(!e) e = cache_claim(blocknum);
+		cache_touch(e);
+		memcpy(e->data,data,DISK_BLOCK_SIZE);
+		e->dirty = 1;
+	}
+	pthread_mutex_unlock(&disk_lock);
+
+	stats_record(&stats.write_latency,stats_now()-start);
+}
+
+static int uring_setup( int depth )
+{
+	int i;
+
+	if(!uring_init(&ring,depth)) return 0;
+
+	requests = malloc(sizeof(*requests)*ring.depth);
+	if(!requests) {
+		uring_exit(&ring);
+		return 0;
+	}
+
+	free_requests = 0;
+	for(i=0;i<(int)ring.depth;i++) {
+		requests[i].next = free_requests;
+		free_requests = &requests[i];
+	}
+	inflight = 0;
+
+	return 1;
+}
+
+// Finish off one completed request, redoing any part the kernel left short.
+static void request_done( struct disk_request *r, int result )
+{
+	struct iovec *iov = r->iov;
+	int iovcnt = r->nblocks;
+	off_t offset = (off_t)r->blocknum*DISK_BLOCK_SIZE;
+
+	if(result<0 && result!=-EINTR && result!=-EAGAIN) {
+		printf("ERROR: couldn't access simulated disk: %s\n",strerror(-result));
+		abort();
+	}
+
+	if(result>0) {
+		offset += result;
+		while(iovcnt>0 && result>=(int)iov->iov_len) {
+			result -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt>0) {
+			iov->iov_base = (char*)iov->iov_base+result;
+			iov->iov_len -= result;
+		}
+	}
+	if(iovcnt>0) file_transfer(r->write,offset,iov,iovcnt);
+
+	r->next = free_requests;
+	free_requests = r;
+	inflight--;
+}
+
+// Submit queued requests and wait for at least wait of them to complete.
+static void reap_requests( int wait )
+{
+	void *tag;
+	int result;
+
+	if(!uring_submit(&ring,wait)) {
+		printf("ERROR: couldn't submit to simulated disk: %s\n",strerror(errno));
+		abort();
+	}
+	while(uring_reap(&ring,&tag,&result)) {
+		request_done(tag,result);
+	}
+}
+
+// Start a transfer of consecutive blocks, asynchronously when the backend allows it
+static void submit_run( int write, int blocknum, struct iovec *iov, int iovcnt )
+{
+	struct disk_request *r;
+	int n;
+
+	if(backend!=DISK_BACKEND_URING) {
+		raw_transfer(write,blocknum,iov,iovcnt);
+		return;
+	}
+
+	while(iovcnt>0) {
+		while(!free_requests) reap_requests(1);
+
+		r = free_requests;
+		free_requests = r->next;
+
+		n = iovcnt<DISK_URING_RUN ? iovcnt : DISK_URING_RUN;
+		r->write = write;
+		r->blocknum = blocknum;
+		r->nblocks = n;
+		memcpy(r->iov,iov,sizeof(*iov)*n);
+
+		uring_queue(&ring,write,diskfd,r->iov,n,(off_t)blocknum*DISK_BLOCK_SIZE,r);
+		inflight++;
+		count_transfer(write,n);
+
+		blocknum += n;
+		iov += n;
+		iovcnt -= n;
+	}
+
+	// get the queue moving without waiting for anything
+	reap_requests(0);
+}
+
+void disk_complete()
+{
+	pthread_mutex_lock(&disk_lock);
+	while(inflight) reap_requests(1);
+	pthread_mutex_unlock(&disk_lock);
+}
+
+// a queued block transfer, remembering its place in the caller's list
+struct pending_io {
+	int blocknum;
+	int order;
+	char *data;
+};
+
+static int compare_io( const void *a, const void *b )
+{
+	const struct pending_io *x = a;
+	const struct pending_io *y = b;
+
+	if(x->blocknum!=y->blocknum) return x->blocknum<y->blocknum ? -1 : 1;
+	return x->order-y->order;
+}
+
+// Sort a request list and issue each run of adjacent blocks as one
+// preadv/pwritev, or as io_uring requests.  Repeated blocks in a write list
+// keep only the last copy.
+static void transfer_runs( int write, struct pending_io *io, int n )
+{
+	struct iovec iov[IOV_MAX];
+	int i, start, count;
+
+	qsort(io,n,sizeof(*io),compare_io);
+
+	i = 0;
+	while(i<n) {
+		start = io[i].blocknum;
+		count = 0;
+		while(i<n && count<IOV_MAX) {
+			if(write && i+1<n && io[i+1].blocknum==io[i].blocknum) {
+				i++;
+				continue;
+			}
+			if(io[i].blocknum!=start+count) break;
+			iov[count].iov_base = io[i].data;
+			iov[count].iov_len = DISK_BLOCK_SIZE;
+			count++;
+			i++;
+		}
+		submit_run(write,start,iov,count);
+	}
+}
+
+static struct pending_io * pending_alloc( int n )
+{
+	struct pending_io *list = malloc(sizeof(*list)*n);
+
+	if(!list) {
+		printf("ERROR: out of memory\n");
+		abort();
+	}
+	return list;
+}
+
+void disk_readv( const struct disk_io *io, int n )
+{
+	long start = stats_now();
+
+	disk_submit_readv(io,n);
+	disk_complete();
+	stats_record(&stats.readv_latency,stats_now()-start);
+}
+
+void disk_writev( const struct disk_io *io, int n )
+{
+	long start = stats_now();
+
+	disk_submit_writev(io,n);
+	disk_complete();
+	stats_record(&stats.writev_latency,stats_now()-start);
+}
+
+void disk_submit_readv( const struct disk_io *io, int n )
+{
+	struct pending_io *miss;
+	struct cache_entry *e;
+	int i, nmiss = 0;
+
+	if(n<=0) return;
+
+	trace_call(DISK_TRACE_READV,io,0,0,n);
+	miss = pending_alloc(n);
+
+	// blocks already in the cache are copied out, the rest go to the image
+	pthread_mutex_lock(&disk_lock);
+	for(i=0;i<n;i++) {
+		sanity_check(io[i].blocknum,io[i].data);
+		e = cache_lookup(io[i].blocknum);
+		if(cache_capacity) count_lookup(e!=0);
+		if(e) {
+			cache_touch(e);
+			memcpy(io[i].data,e->data,DISK_BLOCK_SIZE);
+		} else {
+			miss[nmiss].blocknum = io[i].blocknum;
+			miss[nmiss].order = i;
+			miss[nmiss].data = io[i].data;
+			nmiss++;
+		}
+	}
+
+	// misses land in the caller's buffers, so without a ring to feed
+	// they can be read while other threads use the cache
+	if(backend!=DISK_BACKEND_URING) pthread_mutex_unlock(&disk_lock);
+	transfer_runs(0,miss,nmiss);
+	if(backend==DISK_BACKEND_URING) pthread_mutex_unlock(&disk_lock);
+	free(miss);
+}
+
+void disk_submit_writev( const struct disk_io *io, int n )
+{
+	struct pending_io *list;
+	struct cache_entry *e;
+	int i;
+
+	if(n<=0) return;
+
+	trace_call(DISK_TRACE_WRITEV,io,0,0,n);
+	list = pending_alloc(n);
+
+	// vectored writes go straight to the image, so a cached copy is
+	// refreshed and marked clean rather than written again later
+	pthread_mutex_lock(&disk_lock);
+	for(i=0;i<n;i++) {
+		sanity_check(io[i].blocknum,io[i].data);
+		e = cache_lookup(io[i].blocknum);
+		if(e) {
+			memcpy(e->data,io[i].data,DISK_BLOCK_SIZE);
+			e->dirty = 0;
+		}
+		list[i].blocknum = io[i].blocknum;
+		list[i].order = i;
+		list[i].data = io[i].data;
+	}
+
+	transfer_runs(1,list,n);
+	pthread_mutex_unlock(&disk_lock);
+	free(list);
+}
+
+/*
+Discarding a range tells the image its contents are no longer needed.  The
+range is punched out of the image file where the file system supports it,
+zeroed with FALLOC_FL_ZERO_RANGE otherwise, and written with zeros as a
+last resort, so it always reads back as zeros.
+*/
+
+void disk_discard( int blocknum, int n )
+{
+	off_t offset = (off_t)blocknum*DISK_BLOCK_SIZE;
+	off_t length = (off_t)n*DISK_BLOCK_SIZE;
+	static char zeros[DISK_BLOCK_SIZE];
+	struct iovec iov[IOV_MAX];
+	struct cache_entry *e;
+	int i, count;
+
+	if(n<=0) return;
+	sanity_check(blocknum,zeros);
+	sanity_check(blocknum+n-1,zeros);
+	trace_call(DISK_TRACE_DISCARD,0,0,blocknum,n);
+
+	pthread_mutex_lock(&disk_lock);
+	if(inflight) disk_complete();
+
+	// cached copies are dropped, even dirty ones, since the data is going away
+	for(e=lru.next;cache_capacity && e!=&lru;e=e->next) {
+		if(e->blocknum>=blocknum && e->blocknum<blocknum+n) {
+			hash_remove(e);
+			e->blocknum = -1;
+			e->dirty = 0;
+		}
+	}
+
+	if(fallocate(diskfd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,offset,length)==0 ||
+	   fallocate(diskfd,FALLOC_FL_ZERO_RANGE|FALLOC_FL_KEEP_SIZE,offset,length)==0) {
+		pthread_mutex_unlock(&disk_lock);
+		return;
+	}
+
+	while(n>0) {
+		count = n<IOV_MAX ? n : IOV_MAX;
+		for(i=0;i<count;i++) {
+			iov[i].iov_base = zeros;
+			iov[i].iov_len = DISK_BLOCK_SIZE;
+		}
+		raw_transfer(1,blocknum,iov,count);
+		blocknum += count;
+		n -= count;
+	}
+	pthread_mutex_unlock(&disk_lock);
+}
+
+/*
+Prefetching pulls blocks that are about to be read into the buffer cache,
+issuing the misses as one batch of coalesced reads.  Without a buffer cache
+the request is passed on to the kernel as a will-need hint.
+*/
+
+void disk_prefetch( const int *blocknums, int n )
+{
+	struct pending_io *list;
+	struct cache_entry *e;
+	int i, nlist = 0;
+
+	if(n<=0) return;
+
+	trace_call(DISK_TRACE_PREFETCH,0,blocknums,0,n);
+
+	if(!cache_capacity) {
+		for(i=0;i<n;i++) disk_advise(blocknums[i],1,DISK_ADVISE_WILLNEED);
+		return;
+	}
+
+	// never claim more than half the cache, so a prefetch cannot evict itself
+	if(n>cache_capacity/2) n = cache_capacity/2;
+
+	list = pending_alloc(n);
+	pthread_mutex_lock(&disk_lock);
+	for(i=0;i<n;i++) {
+		sanity_check(blocknums[i],blocknums);
+		if(cache_lookup(blocknums[i])) continue;
+		e = cache_claim(blocknums[i]);
+		cache_touch(e);
+		list[nlist].blocknum = blocknums[i];
+		list[nlist].order = nlist;
+		list[nlist].data = e->data;
+		nlist++;
+	}
+
+	transfer_runs(0,list,nlist);
+	disk_complete();
+	pthread_mutex_unlock(&disk_lock);
+	free(list);
+}
+
+const char * disk_block_ptr( int blocknum )
+{
+	if(!diskmap) return 0;
+
+	sanity_check(blocknum,diskmap);
+	trace_call(DISK_TRACE_READ,0,0,blocknum,1);
+	count_transfer(0,1);
+
+	return diskmap+(size_t)blocknum*DISK_BLOCK_SIZE;
+}
+
+void disk_advise( int blocknum, int n, int advice )
+{
+	size_t offset = (size_t)blocknum*DISK_BLOCK_SIZE;
+	size_t length = (size_t)n*DISK_BLOCK_SIZE;
+
+	if(n<=0 || blocknum<0 || blocknum+n>nblocks) return;
+
+	if(diskmap) {
+		madvise(diskmap+offset,length,advice==DISK_ADVISE_SEQUENTIAL ? MADV_SEQUENTIAL : MADV_WILLNEED);
+	} else if(diskfd>=0) {
+		posix_fadvise(diskfd,offset,length,advice==DISK_ADVISE_SEQUENTIAL ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_WILLNEED);
+	}
+}
+
+// Report the block transfers to and from the image file so far
+void disk_counts( int *reads, int *writes )
+{
+	*reads = __atomic_load_n(&nreads,__ATOMIC_RELAXED);
+	*writes = __atomic_load_n(&nwrites,__ATOMIC_RELAXED);
+}
+
+// Name the class of the blocks the calling thread moves from now on.  Returns the class it replaces.
+int disk_class( int class )
+{
+	int old = io_class;
+
+	if(class>=0 && class<DISK_CLASSES) io_class = class;
+	return old;
+}
+
+// Copy out the counters and latency histograms since the last reset
+void disk_stats( struct disk_stats *s )
+{
+	int i;
+
+	memset(s,0,sizeof(*s));
+	for(i=0;i<DISK_CLASSES;i++) {
+		s->classes[i].reads = __atomic_load_n(&stats.classes[i].reads,__ATOMIC_RELAXED);
+		s->classes[i].writes = __atomic_load_n(&stats.classes[i].writes,__ATOMIC_RELAXED);
+		s->classes[i].hits = __atomic_load_n(&stats.classes[i].hits,__ATOMIC_RELAXED);
+		s->classes[i].misses = __atomic_load_n(&stats.classes[i].misses,__ATOMIC_RELAXED);
+	}
+	stats_add(&s->read_latency,&stats.read_latency);
+	stats_add(&s->write_latency,&stats.write_latency);
+	stats_add(&s->readv_latency,&stats.readv_latency);
+	stats_add(&s->writev_latency,&stats.writev_latency);
+}
+
+// Copy out the running totals of the calling thread, which are never reset
+void disk_thread_stats( struct disk_class_stats *classes )
+{
+	memcpy(classes,thread_stats,sizeof(thread_stats));
+}
+
+// Start the counters and histograms over.  Calls in progress may still add to them.
+void disk_stats_reset()
+{
+	long *p = (long*)&stats;   // the stats are nothing but longs
+	size_t i;
+
+	for(i=0;i<sizeof(stats)/sizeof(long);i++) __atomic_store_n(&p[i],0,__ATOMIC_RELAXED);
+}
+
+// Name the operation the calling thread works for, as recorded in a trace.  Returns the one it replaces.
+int disk_caller( int op )
+{
+	int old = trace_caller;
+
+	trace_caller = op>=0 && op<DISK_TRACE_NONE ? op : DISK_TRACE_NONE;
+	return old;
+}
+
+// Start recording every block request to filename, replacing any trace in progress
+int disk_trace_start( const char *filename )
+{
+	struct disk_trace_header h;
+	int fd;
+
+	disk_trace_stop();
+
+	fd = open(filename,O_WRONLY|O_CREAT|O_TRUNC,0666);
+	if(fd<0) return 0;
+
+	memset(&h,0,sizeof(h));
+	h.magic = DISK_TRACE_MAGIC;
+	h.version = DISK_TRACE_VERSION;
+	h.nblocks = nblocks;
+	if(write(fd,&h,sizeof(h))!=sizeof(h)) {
+		close(fd);
+		return 0;
+	}
+
+	pthread_mutex_lock(&trace_lock);
+	trace_buf = malloc(sizeof(*trace_buf)*TRACE_BUFFER);
+	if(!trace_buf) {
+		pthread_mutex_unlock(&trace_lock);
+		close(fd);
+		return 0;
+	}
+	trace_n = 0;
+	trace_start = stats_now();
+	__atomic_store_n(&trace_fd,fd,__ATOMIC_RELAXED);
+	pthread_mutex_unlock(&trace_lock);
+
+	return 1;
+}
+
+// Write out what is left of the trace and close it
+void disk_trace_stop()
+{
+	pthread_mutex_lock(&trace_lock);
+	if(trace_fd>=0) {
+		trace_flush();
+		if(trace_fd>=0) close(trace_fd);
+		__atomic_store_n(&trace_fd,-1,__ATOMIC_RELAXED);
+	}
+	free(trace_buf);
+	trace_buf = 0;
+	trace_n = 0;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void disk_close()
+{
+	disk_trace_stop();
+
+	if(diskfd>=0) {
+		disk_sync();
+		printf("%d disk block reads\n",nreads);
+		printf("%d disk block writes\n",nwrites);
+		printf("%d cache hits, %d cache misses\n",cache_hits,cache_misses);
+		if(diskmap) munmap(diskmap,(size_t)nblocks*DISK_BLOCK_SIZE);
+		diskmap = 0;
+		if(backend==DISK_BACKEND_URING) {
+			uring_exit(&ring);
+			free(requests);
+			requests = 0;
+			free_requests = 0;
+		}
+		close(diskfd);
+		diskfd = -1;
+	}
+}
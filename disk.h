@@ -1,13 +1,123 @@
-#ifndef DISK_H
-#define DISK_H
-
-#define DISK_BLOCK_SIZE 4096
-
-int  disk_init( const char *filename, int nblocks );
-int  disk_size();
-void disk_read( int blocknum, char *data );
-void disk_write( int blocknum, const char *data );
-void disk_close();
-
-
-#endif
\ No newline at end of file
+#ifndef DISK_H
+#define DISK_H
+
+#include <stdint.h>
+
+#include "stats.h"
+
+#define DISK_BLOCK_SIZE 4096
+
+// number of blocks held by the buffer cache unless disk_cache_size is called
+#define DISK_CACHE_DEFAULT 256
+
+// backends for disk_init_backend
+#define DISK_BACKEND_PREAD 0
+#define DISK_BACKEND_MMAP  1
+#define DISK_BACKEND_URING 2
+
+// requests kept in flight by the io_uring backend unless disk_queue_depth is called
+#define DISK_QUEUE_DEPTH 32
+
+// most blocks moved by one io_uring request
+#define DISK_URING_RUN 32
+
+// access hints for disk_advise
+#define DISK_ADVISE_SEQUENTIAL 0
+#define DISK_ADVISE_WILLNEED   1
+
+// kinds of block a caller can say it is moving with disk_class, so transfers are counted apart
+#define DISK_CLASS_META     0   // superblock, inode table, bitmap and journal
+#define DISK_CLASS_DATA     1
+#define DISK_CLASS_INDIRECT 2
+#define DISK_CLASSES        3
+
+// one block of a vectored request
+struct disk_io {
+	int blocknum;
+	char *data;
+};
+
+// block traffic of one class
+struct disk_class_stats {
+	long reads;     // blocks read from the image
+	long writes;    // blocks written to the image
+	long hits;      // block reads served by the buffer cache
+	long misses;    // block reads the buffer cache had to fetch
+};
+
+// counters since the last disk_stats_reset
+struct disk_stats {
+	struct disk_class_stats classes[DISK_CLASSES];
+	struct stats_histogram read_latency;     // disk_read calls
+	struct stats_histogram write_latency;    // disk_write calls
+	struct stats_histogram readv_latency;    // disk_readv calls
+	struct stats_histogram writev_latency;   // disk_writev calls
+};
+
+/*
+A block I/O trace is a disk_trace_header followed by one disk_trace_record per
+run of adjacent blocks named in a call.  A vectored call, prefetch or long
+discard that covers several runs writes them back to back, each one after the
+first carrying DISK_TRACE_MORE.
+*/
+
+#define DISK_TRACE_MAGIC   0x53465452
+#define DISK_TRACE_VERSION 1
+
+// calls recorded in a trace
+#define DISK_TRACE_READ     0
+#define DISK_TRACE_WRITE    1
+#define DISK_TRACE_READV    2
+#define DISK_TRACE_WRITEV   3
+#define DISK_TRACE_PREFETCH 4
+#define DISK_TRACE_DISCARD  5
+#define DISK_TRACE_SYNC     6
+#define DISK_TRACE_MORE     0x80   // the record continues the call of the one before it
+
+// caller recorded outside any operation named with disk_caller
+#define DISK_TRACE_NONE 255
+
+struct disk_trace_header {
+	uint32_t magic;
+	uint32_t version;
+	int32_t nblocks;      // size of the traced image
+	uint32_t reserved;
+};
+
+struct disk_trace_record {
+	uint64_t time;        // nanoseconds since the trace was started
+	int32_t blocknum;
+	uint16_t nblocks;     // length of the run starting at blocknum
+	uint8_t op;
+	uint8_t caller;
+};
+
+int  disk_init( const char *filename, int nblocks );
+int  disk_init_backend( const char *filename, int nblocks, int backend );
+void disk_queue_depth( int depth );
+int  disk_size();
+void disk_read( int blocknum, char *data );
+void disk_write( int blocknum, const char *data );
+void disk_readv( const struct disk_io *io, int n );
+void disk_writev( const struct disk_io *io, int n );
+void disk_submit_readv( const struct disk_io *io, int n );
+void disk_submit_writev( const struct disk_io *io, int n );
+void disk_complete();
+void disk_discard( int blocknum, int n );
+void disk_prefetch( const int *blocknums, int n );
+int  disk_cache_size( int nblocks );
+const char * disk_block_ptr( int blocknum );
+void disk_advise( int blocknum, int n, int advice );
+void disk_sync();
+void disk_counts( int *reads, int *writes );
+int  disk_class( int class );
+void disk_stats( struct disk_stats *s );
+void disk_thread_stats( struct disk_class_stats *classes );
+void disk_stats_reset();
+int  disk_caller( int op );
+int  disk_trace_start( const char *filename );
+void disk_trace_stop();
+void disk_close();
+
+
+#endif
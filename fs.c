@@ -1,596 +1,3327 @@
-/*
-
-csci5103_project3
-
-File Systems
-
-Bryan Baker - bake1358@umn.edu
-Alice Anderegg - and08613@umn.edu
-Hailin Archer - deak0007@umn.edu
-
-*/
-
-#include "fs.h"
-#include "disk.h"
-
-#include <stdio.h>
-#include <math.h>
-#include <string.h>
-#include <stdlib.h>
-#include <errno.h>
-#include <unistd.h>
-#include <stdbool.h>
-#include <sys/param.h>
-
-#define FS_MAGIC           0xf0f03410
-#define INODES_PER_BLOCK   128
-#define POINTERS_PER_INODE 5
-#define POINTERS_PER_BLOCK 1024
-
-#define FREE 				0
-#define BUSY				1
-
-bool fs_mounted = false;
-char* freemap;
-
-struct fs_superblock {
-	int magic;
-	int nblocks;
-	int ninodeblocks;
-	int ninodes;
-};
-
-struct fs_inode {
-	int isvalid;
-	int size;
-	int direct[POINTERS_PER_INODE];
-	int indirect;
-};
-
-union fs_block {
-	struct fs_superblock super;
-	struct fs_inode inode[INODES_PER_BLOCK];
-	int pointers[POINTERS_PER_BLOCK];
-	char data[DISK_BLOCK_SIZE];
-};
-
-// Find an inode block using an inode number
-void inode_load(int inumber, struct fs_inode *inode)
-{
-	union fs_block inode_block;
-	disk_read(1 + (inumber / INODES_PER_BLOCK), inode_block.data);
-	*inode = inode_block.inode[inumber % INODES_PER_BLOCK];
-}
-
-// Save an inode block using an inode number
-void inode_save(int inumber, struct fs_inode *inode)
-{
-	union fs_block inode_block;
-	disk_read(1 + (inumber / INODES_PER_BLOCK), inode_block.data);
-	inode_block.inode[inumber % INODES_PER_BLOCK] = *inode;
-	disk_write(1 + (inumber / INODES_PER_BLOCK), inode_block.data);
-}
-
-// Get a count of valid inodes saved to the disk
-int get_inode_cnt()
-{
-	union fs_block super_block;
-	union fs_block inode_block;
-	int i, j;
-	int cnt = 0;
-
-	disk_read(0,super_block.data);
-
-	for ( i = 0; i < super_block.super.ninodeblocks; i++ ) {
-		disk_read((i + 1), inode_block.data);
-		for ( j = 0; j < INODES_PER_BLOCK; j++ ) {
-			if ( inode_block.inode[j].isvalid ) {
-				cnt++;
-			}
-		}
-	}
-	return cnt;
-}
-
-// Find a free block to aid in writing data
-int find_free_block()
-{
-	int i;
-
-	for (i = 1; i < disk_size(); i++ ) {
-		if (freemap[i] != BUSY) {
-			return i;
-		}
-	}
-	return -1;
-}
-
-// Format file system
-int fs_format()
-{
-	union fs_block super_block;
-	union fs_block empty_block;
-	int i;
-	char validate;
-	int inode_val;
-
-	// don't format if file system has been mounted
-	if ( fs_mounted ) {
-		printf("fs_format: file system already mounted\n");
-		return 0;
-	}
-
-	// Read superblock
-	disk_read(0,super_block.data);
-
-	// Check if the file system has already been formatted and ask to reformat it.
-	if (super_block.super.magic == FS_MAGIC) {
-		printf("This disk has already been formated.\n");
-		printf("Reformatting will erase the contents.\n");
-		printf("Continue? (y/n) > ");
-		scanf("%c", &validate);
-		if (validate != 'y') {
-			printf("fs_format: abort\n");
-			return 0;
-		}
-	}
-
-	memset(empty_block.data, 0, sizeof(empty_block));
-
-	// Set attributes of superblock for the file system
-	super_block.super.magic = FS_MAGIC;
-	super_block.super.nblocks = disk_size();
-	inode_val = ceil(disk_size() / 10);
-	if (inode_val == 0) {
-		inode_val = 1; // create at least 1 inode block
-	}
-	super_block.super.ninodeblocks = inode_val;
-	super_block.super.ninodes = inode_val * INODES_PER_BLOCK;
-
-	// Save the superblock to the file system
-	disk_write(0, super_block.data);
-
-	// Zero out all other datablocks.  
-	for ( i = 1; i < disk_size(); i++ ) {
-		disk_write(i, empty_block.data);
-	}
-
-	return 1;
-}
-
-// Debug function
-void fs_debug()
-{
-	union fs_block super_block;
-	union fs_block inode_block;
-	union fs_block indirect_block;
-	int i, j, k;
-
-	// Read super block for attributes of file system.
-	disk_read(0,super_block.data);
-
-	// Check if the file system has been formatted.
-	printf("superblock:\n");
-	if (super_block.super.magic == FS_MAGIC) {
-		printf("    magic number is valid\n");
-	} else {
-		printf("    magic number is invalid. aborting\n");
-		return;
-	}
-
-	// Print the number of blocks, inode blocks, and inodes.
-	printf("    %d blocks on disk\n",super_block.super.nblocks);
-	printf("    %d inode blocks\n",super_block.super.ninodeblocks);
-	printf("    %d inodes total\n",super_block.super.ninodes);
-
-	// Print information on each valid inode
-	for ( i = 0; i < super_block.super.ninodeblocks; i++ ) {
-		disk_read((i + 1), inode_block.data);
-		for ( j = 0; j < INODES_PER_BLOCK; j++ ) {
-			if ( inode_block.inode[j].isvalid ) {
-				printf("inode %d:\n", ( i * INODES_PER_BLOCK ) + j);
-				printf("    size: %d bytes\n", inode_block.inode[j].size);
-				printf("    direct blocks: ");
-				for ( k = 0; k < POINTERS_PER_INODE; k++ ) {
-					if ( inode_block.inode[j].direct[k] != 0 ) {
-						printf("%d ", inode_block.inode[j].direct[k]);  // Printing the number of direct data blocks for a valid inode
-					}
-				}
-				printf("\n");
-				if ( inode_block.inode[j].indirect != 0 ) {
-					printf("    indirect block: %d\n", inode_block.inode[j].indirect);
-					disk_read(inode_block.inode[j].indirect, indirect_block.data);
-					printf("    indirect data blocks: ");
-					for (k = 0; k < POINTERS_PER_BLOCK; k++ ) {
-						if ( indirect_block.pointers[k] != 0 ) {
-							printf("%d ", indirect_block.pointers[k]);  // Printing the number of indirect data blocks for a valid inode if they exist.
-						}
-					}
-					printf("\n");
-				}
-			}
-		}
-	}
-}
-
-// Mount file system
-int fs_mount()
-{
-	union fs_block super_block;
-	union fs_block inode_block;
-	union fs_block indirect_block;
-
-	int i,j,k;
-
-	// make sure there's not already a file system mounted
-	if (fs_mounted ) {
-		printf("fs_mount: file system already mounted\n");
-		return 0;
-	}
-
-	// Read superblock data
-	disk_read(0,super_block.data);
-
-	// make sure a file system exists on the disk
-	if ( super_block.super.magic != FS_MAGIC ) {
-		printf("fs_mount: file system invalid format\n");
-		return 0;
-	}
-
-	// create an array for our free block bitmap and zero it out
-	freemap = (char*) malloc(disk_size() * sizeof(char));
-	memset(freemap, FREE, disk_size());
-
-	// we at least have an occupied super block and some inode blocks
-	memset(freemap, BUSY, 1 + super_block.super.ninodeblocks);
-
-	// for each inode, figure out direct blocks, indirect blocks, and indirect data blocks
-	for ( i = 0; i < super_block.super.ninodeblocks; i++ ) {
-		disk_read((i + 1), inode_block.data);
-		for ( j = 0; j < INODES_PER_BLOCK; j++ ) {
-			if ( inode_block.inode[j].isvalid ) {
-				for ( k = 0; k < POINTERS_PER_INODE; k++ ) {
-
-					if ( inode_block.inode[j].direct[k] != 0 ) {
-						// mark all used direct blocks as busy
-						freemap[inode_block.inode[j].direct[k]] = BUSY;
-					}
-				}
-
-				if ( inode_block.inode[j].indirect != 0 ) {
-					// mark indirect block as busy
-					freemap[inode_block.inode[j].indirect] = BUSY;
-
-					disk_read(inode_block.inode[j].indirect, indirect_block.data);
-
-					for (k = 0; k < POINTERS_PER_BLOCK; k++ ) {
-						if ( indirect_block.pointers[k] != 0 ) {
-							// mark indirect data blocks as busy
-							freemap[indirect_block.pointers[k]] = BUSY;
-						}
-					}
-				}
-			}
-		}
-	}
-
-	fs_mounted = true;
-
-	return 1;
-}
-
-// Create a valid inode
-int fs_create()
-{
-	union fs_block super_block;
-	struct fs_inode inode;
-	int i;
-	int inumber = -1;
-
-	// Check if the file system has been mounted.
-	if ( !fs_mounted ) {
-		printf("fs_create: can't create inode. no file system mounted\n");
-		return -1;
-	}
-
-	// Read the super block data
-	disk_read(0, super_block.data);
-
-	// If the maximum number of inodes have been created then exit
-	if (get_inode_cnt() == super_block.super.ninodes) {
-		printf("fs_create: can't create inode. inode table is full\n");
-		return -1;
-	}
-
-	// find a free inode slot
-	for ( i = 0; i < super_block.super.ninodeblocks * INODES_PER_BLOCK; i++ ) {
-		inode_load( i, &inode);
-		if (!inode.isvalid) {
-			// found a free slot, let's put our new inode there
-			inumber = i;
-			memset((char*)&inode, 0, sizeof(inode));
-			inode.isvalid = 1;
-			inode.indirect = 0;
-			inode_save(inumber, &inode);
-
-			break;
-		}
-	}
-
-	// Return the newly created inode number.
-	return inumber;
-}
-
-// Delete an inode from the file system
-int fs_delete( int inumber )
-{
-	union fs_block super_block;
-	struct fs_inode inode;
-	union fs_block indirect_block;
-	union fs_block empty_block;
-	int i;
-
-	// validate file system mounted
-	if ( !fs_mounted ) {
-		printf("fs_delete: can't delete inode. no file system mounted\n");
-		return 0;
-	}
-
-	// validate inumber
-	disk_read(0, super_block.data);
-	if (inumber >= super_block.super.ninodes) {
-		printf("fs_delete: can't delete inode. inode number must be less than %d\n",
-				super_block.super.ninodes);
-		return 0;
-	}
-
-	// Create an empty block of data to overwrite data being deleted.  
-	memset(empty_block.data, 0, sizeof(empty_block));
-
-	// Find the inode and make sure it is a valid inode
-	inode_load(inumber, &inode);
-	if (!inode.isvalid) {
-		printf("fs_delete: can't delete inode. inode is not valid. Abort.\n");
-		return 0;
-	}
-
-	// release direct data from freemap and overwrite with empty data
-	for (i = 0; i < POINTERS_PER_INODE; i++) {
-		if ( inode.direct[i] != 0 ) {
-			disk_write(inode.direct[i], empty_block.data);
-			freemap[inode.direct[i]] = FREE;
-		}
-	}
-
-	// check for indirect data
-	if ( inode.indirect != 0 ) {
-		disk_read(inode.indirect, indirect_block.data);
-
-		// clear indirect data blocks from freemap and overwrite with empty data
-		for (i = 0; i < POINTERS_PER_BLOCK; i++) {
-			if (indirect_block.pointers[i] != 0) {
-				disk_write(indirect_block.pointers[i], empty_block.data);
-				freemap[indirect_block.pointers[i]] = FREE;
-			}
-		}
-
-		// clear the indirect pointers themselves from freemap and overwrite with empty data
-		disk_write(inode.indirect, empty_block.data);
-		freemap[inode.indirect] = FREE;
-	}
-
-	// delete the inode and save it
-	memset(&inode, 0, sizeof(inode));
-	inode_save(inumber, &inode);
-	freemap[0] = BUSY;
-
-	return 1;
-}
-
-// Get the amount of data associated with an inode
-int fs_getsize( int inumber )
-{
-	struct fs_inode inode;
-
-	// Check if the file system is mounted
-	if (!fs_mounted) {
-		printf("fs_getsize: no file system mounted\n");
-		return -1;
-	}
-
-	inode_load(inumber, &inode);
-
-	// Check if the inode is a valid node for the file system
-	if (!inode.isvalid) {
-		printf("fs_getsize: invalid inode number\n");
-		return -1;
-	}
-
-	// Return the size of the data.
-	return inode.size;
-}
-
-// read data from the file system
-int fs_read( int inumber, char *data, int length, int offset )
-{
-	struct fs_inode inode;
-	union fs_block super_block;
-	int block_offset;
-	int byte_offset;
-	int block_number;
-	int bytes_read = 0;
-
-	// Check if the file system is mounted
-	if (!fs_mounted) {
-		printf("fs_read: no file system mounted\n");
-		return 0;
-	}
-
-	// Read the super block
-	disk_read(0, super_block.data);
-
-	// Check is the inode value is less than the max number of inodes possible in the file system.
-	if (inumber >= super_block.super.ninodes ) {
-		printf("fs_read: invalid inode number must be less than %d\n",
-				super_block.super.ninodes);
-		return 0;
-	}
-
-	inode_load(inumber, &inode);
-
-	// Check that the inode is valid.
-	if (!inode.isvalid) {
-		printf("fs_read: no inode data present for inode %d\n", inumber);
-		return 0;
-	}
-
-	// return here if the offset doesn't make sense
-	if ( offset >= inode.size ) {
-		return 0;
-	}
-
-	// make sure we don't try to read past the end of the inode
-	if (inode.size < offset + length ) {
-		length = inode.size - offset;
-	}
-
-	// translate starting offset to block terms
-	block_offset = offset / DISK_BLOCK_SIZE;
-	byte_offset = offset % DISK_BLOCK_SIZE;
-
-	while ( bytes_read < length ) {
-
-		union fs_block block;
-		int bytes_to_read;
-
-		// find the block pointer and read the block
-		if ( block_offset < POINTERS_PER_INODE ) {
-			block_number = inode.direct[block_offset];  // direct inodes
-		} else {
-			disk_read(inode.indirect, block.data);
-			block_number = block.pointers[block_offset - POINTERS_PER_INODE];  // indirect inodes 
-		}
-		disk_read(block_number, block.data);
-
-		// figure out how many bytes we need out of this block
-		bytes_to_read = MIN(DISK_BLOCK_SIZE - byte_offset, length - bytes_read);
-
-		// copy data into the output buffer
-		strncpy(data + bytes_read, block.data + byte_offset, bytes_to_read);
-		bytes_read += bytes_to_read;
-
-		byte_offset = 0;
-		block_offset++;
-	}
-
-	return bytes_read;
-}
-
-// Write data to the file system.
-int fs_write( int inumber, const char *data, int length, int offset )
-{
-	struct fs_inode inode;
-	union fs_block super_block;
-	union fs_block indirect_block;
-	int block_offset = 0;
-	int byte_offset;
-	int bytes_written = 0;
-	int i;
-
-	// Check if the file system is mounted.
-	if (!fs_mounted) {
-		printf("fs_write: no file system mounted\n");
-		return 0;
-	}
-
-	// Read the super block data
-	disk_read(0, super_block.data);
-
-	// Check that the inode requested is less than the max number of inodes in the file system.
-	if (inumber >= super_block.super.ninodes ) {
-		printf("fs_write: invalid inode number must be less than %d\n",
-				super_block.super.ninodes);
-		return 0;
-	}
-
-	inode_load(inumber, &inode);
-
-	// Check that the inode is a valid inode
-	if (!inode.isvalid) {
-		printf("fs_write: no inode data present for inode %d\n", inumber);
-		return 0;
-	}
-
-	// translate starting offset to block terms
-	// Data will be written so we must find out the block offset to use for new data
-	for (i = 0; i < POINTERS_PER_INODE; i++) {
-		if (inode.direct[i] > 0) { // Take direct nodes into account
-			block_offset++;
-		}
-	}
-	if (inode.indirect) {
-		disk_read(inode.indirect, indirect_block.data);
-		for (i = 0; i < POINTERS_PER_BLOCK; i++) {
-			if (indirect_block.pointers[i] > 0) {  // Take indirect nodes into account
-				block_offset++;
-			}
-		}
-	}
-
-	// The offset is the cursor used while parsing through the buffer.
-	byte_offset = offset;
-
-	// Write while there are bytes to write
-	while ( bytes_written < length ) {
-
-		union fs_block data_block;
-		int bytes_to_write;
-		int write_block;
-
-		// Find a free block to use when we want to write data to a block.
-		write_block = find_free_block();
-
-		// If there are no more free blocks the disk is full.
-		if (write_block < 0) {
-			printf("fs_write: disk is full\n");
-			return 0;
-		}
-
-		// figure out how many bytes we need to write to this block
-		bytes_to_write = MIN(DISK_BLOCK_SIZE, length - bytes_written);
-
-		// copy data from the input buffer
-		strncpy(data_block.data, data + bytes_written, bytes_to_write);
-
-		// Fill direct inodes first
-		if (block_offset < POINTERS_PER_INODE ) {
-			inode.direct[block_offset] = write_block;
-		} else { // Now fill indirect inodes
-			if (!inode.indirect) {  // If there isn't an indirect block created, then create one
-				inode.indirect = write_block;
-				memset(indirect_block.data, 0, sizeof(indirect_block));
-				disk_write(write_block,indirect_block.data);
-				freemap[write_block] = BUSY;
-				write_block = find_free_block(); // Find a new write block since we used ours to create the indirect block
-				if (write_block < 0) {  // Check if disk is full
-					printf("fs_write: disk is full\n");
-					return 0;
-				}
-			}
-			disk_read(inode.indirect, indirect_block.data); // Read indirect data block
-			indirect_block.pointers[block_offset - POINTERS_PER_INODE] = write_block;
-			disk_write(inode.indirect, indirect_block.data);  // Write the block number which will be used for data
-		}
-		disk_write (write_block, data_block.data);  // Write the data to the block chosen
-		freemap[write_block] = BUSY;  // Mark the freemap as busy for the chosen block
-
-		bytes_written += bytes_to_write;  // Track the number of bytes written to data blocks.
-
-		byte_offset =+ byte_offset; // Increment the data cursor.
-		block_offset++;  // Increment the number of blocks written to the file system for this inode.
-	}
-	// Keep track of the inode size and write the meta data to the file system.
-	inode.size = inode.size + bytes_written;
-	inode_save(inumber, &inode);
-	return bytes_written;
-}
+/*
+
+csci5103_project3
+
+File Systems
+
+Bryan Baker - bake1358@umn.edu
+Alice Anderegg - and08613@umn.edu
+Hailin Archer - deak0007@umn.edu
+
+*/
+
+#define _GNU_SOURCE
+#include "fs.h"
+#include "disk.h"
+#include "bitmap.h"
+#include "lz.h"
+#include "xxhash.h"
+
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/param.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define FS_MAGIC           0xf0f03410
+#define INODES_PER_BLOCK   128
+#define POINTERS_PER_INODE 5
+#define POINTERS_PER_BLOCK 1024
+#define BITS_PER_BLOCK     (DISK_BLOCK_SIZE * 8)
+#define MOUNT_BATCH        64
+#define VIEW_MAX_BLOCKS    256
+#define READAHEAD_MIN      4
+#define READAHEAD_MAX      64
+#define SCAN_MAX_THREADS   16
+#define INODE_LOCKS        1024
+#define GROUP_BLOCKS       4096   // one summary word of the free block bitmap, so groups never share a word
+#define JOURNAL_MAGIC      0x6a726e6c
+#define JOURNAL_COMMIT     0x636d6974
+#define JOURNAL_DESC_MAX   1021   // block numbers that fit in a descriptor block after its header
+#define JOURNAL_MIN_BLOCKS 8
+#define JOURNAL_MAX_BLOCKS 1024
+#define JOURNAL_BATCH      32     // operations grouped into one commit
+#define OPEN_FILES         256    // handles open at once
+#define CLUSTER_BLOCKS     8      // blocks compressed together in a compressed file
+#define CLUSTER_BYTES      (CLUSTER_BLOCKS * DISK_BLOCK_SIZE)
+#define CLUSTER_PACKED     (-1)   // pointer of a block not needed by the compressed cluster it is in
+#define INODE_VALID        1      // isvalid flags
+#define INODE_COMPRESSED   2
+#define INODE_DEDUP        4
+#define DEDUP_MIN_BUCKETS  1024
+
+bool fs_mounted = false;
+struct bitmap freemap;
+
+struct fs_superblock {
+	int magic;
+	int nblocks;
+	int ninodeblocks;
+	int ninodes;
+	int bitmapstart;     // first block of the on-disk free block bitmap, 0 on older images
+	int nbitmapblocks;
+	int clean;           // set while the image is unmounted and the bitmap is up to date
+	int journalstart;    // first block of the metadata journal, 0 on older images
+	int njournalblocks;
+};
+
+struct fs_inode {
+	int isvalid;
+	int size;
+	int direct[POINTERS_PER_INODE];
+	int indirect;
+};
+
+// First block of a journal transaction: the home block numbers of the blocks that follow it
+struct fs_journal_desc {
+	int magic;
+	int sequence;
+	int nblocks;
+	int blocknums[JOURNAL_DESC_MAX];
+};
+
+// Block written after the logged blocks.  A transaction without a matching one is ignored.
+struct fs_journal_commit {
+	int magic;
+	int sequence;
+	int nblocks;
+	unsigned int checksum;
+};
+
+union fs_block {
+	struct fs_superblock super;
+	struct fs_journal_desc desc;
+	struct fs_journal_commit commit;
+	struct fs_inode inode[INODES_PER_BLOCK];
+	int pointers[POINTERS_PER_BLOCK];
+	char data[DISK_BLOCK_SIZE];
+};
+
+// Superblock and inode table pinned in memory while the file system is mounted
+struct fs_superblock super;
+struct fs_inode *inode_table;
+unsigned char *inode_dirty;
+
+/*
+Locking.  The fs_* calls may be made from several threads once the file system is mounted; mount,
+unmount, format and check must not race with anything else.  Each inode is covered by a reader/writer lock
+taken from a table of INODE_LOCKS (inode number modulo the table size), held shared by fs_read and
+friends and exclusive by fs_write and fs_delete.  table_lock guards the dirty bits of the inode
+table, the inode map and the inode count, each allocation group's lock guards its part of the
+free block bitmap, and dedup_lock the shared block counts.  Locks are taken in that order: inode,
+then table, dedup or one group at a time, then the disk layer's own lock.
+*/
+struct fs_inode_lock {
+	pthread_rwlock_t lock;
+	unsigned long gen;    // bumped whenever the block pointers of an inode under this lock change
+};
+struct fs_inode_lock inode_locks[INODE_LOCKS];
+unsigned long inode_clock;
+pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t inode_locks_once = PTHREAD_ONCE_INIT;
+
+// The free block bitmap is split into allocation groups of GROUP_BLOCKS blocks, each searched and
+// counted under its own lock.  A file grows from its last block, a new file starts in the group of
+// its inode block, and when that group is busy or full a thread falls back to a group of its own.
+struct fs_group {
+	pthread_mutex_t lock;
+	int start;
+	int end;
+	int cursor;
+	int nfree;
+};
+struct fs_group *groups;
+int ngroups;
+int group_clock;
+__thread int thread_group = -1;
+
+// Indirect pointers and read-ahead state of the most recently read file, one per thread.
+// The map is only trusted while the generation of its inode's lock has not moved on.
+struct fs_blockmap {
+	int inumber;
+	int indirect;
+	unsigned long gen;
+	union fs_block pointers;
+	int next_offset;
+	int window;
+	int ra_end;
+	int cluster;          // cluster of a compressed file held in cluster_data, or -1
+	char cluster_data[CLUSTER_BYTES];
+};
+__thread struct fs_blockmap blockmap = { .inumber = -1 };
+
+// An open file handle.  It pins a copy of the inode and a block map of its own, checked once at open
+// and only reloaded when the inode's lock generation shows the file was changed by some other path.
+// A valid inode cannot be deleted while a handle to it is open.  A handle is used by one thread at a time.
+struct fs_file {
+	int inumber;
+	int offset;           // file cursor
+	bool written;         // metadata changed through this handle, written back at close
+	struct fs_inode inode;
+	struct fs_blockmap map;
+};
+struct fs_file *files[OPEN_FILES];
+pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Map of inode slots in use and a live count of valid inodes, built at mount
+struct bitmap inodemap;
+int inode_cnt;
+
+// Per operation statistics.  Each public call is timed, and the block traffic the disk layer counted
+// for the calling thread meanwhile is charged to it, along with that of any helper thread it started.
+struct fs_op_stats op_stats[FS_OPS];
+__thread struct disk_class_stats helper_io[DISK_CLASSES];
+
+// The start of one timed call
+struct fs_op_timer {
+	int op;
+	int caller;           // operation the disk layer was told about before this one
+	long start;
+	struct disk_class_stats io[DISK_CLASSES];
+};
+
+// Set up the inode lock table, once per process
+void inode_locks_init()
+{
+	int i;
+
+	for ( i = 0; i < INODE_LOCKS; i++ ) {
+		pthread_rwlock_init(&inode_locks[i].lock, NULL);
+	}
+}
+
+// Lock an inode for reading or, when exclusive is set, for writing
+void inode_lock(int inumber, bool exclusive)
+{
+	if ( exclusive ) {
+		pthread_rwlock_wrlock(&inode_locks[inumber % INODE_LOCKS].lock);
+	} else {
+		pthread_rwlock_rdlock(&inode_locks[inumber % INODE_LOCKS].lock);
+	}
+}
+
+void inode_unlock(int inumber)
+{
+	pthread_rwlock_unlock(&inode_locks[inumber % INODE_LOCKS].lock);
+}
+
+// Find an inode using an inode number
+void inode_load(int inumber, struct fs_inode *inode)
+{
+	*inode = inode_table[inumber];
+}
+
+// Save an inode using an inode number.  The inode block is written at the next flush.
+void inode_save(int inumber, struct fs_inode *inode)
+{
+	pthread_mutex_lock(&table_lock);
+	inode_table[inumber] = *inode;
+	inode_dirty[inumber / 8] |= 1 << (inumber % 8);
+	pthread_mutex_unlock(&table_lock);
+}
+
+// Does inode block i hold a dirty inode.  The caller holds table_lock.
+bool inode_block_dirty(int i)
+{
+	int j;
+
+	for ( j = 0; j < INODES_PER_BLOCK / 8; j++ ) {
+		if ( inode_dirty[(i * INODES_PER_BLOCK / 8) + j] ) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Write every inode block holding a dirty inode back to the disk, once per block
+void inode_flush()
+{
+	union fs_block inode_block;
+	int i;
+
+	pthread_mutex_lock(&table_lock);
+	for ( i = 0; i < super.ninodeblocks; i++ ) {
+		if ( !inode_block_dirty(i) ) {
+			continue;
+		}
+		memcpy(inode_block.inode, &inode_table[i * INODES_PER_BLOCK], sizeof(inode_block.inode));
+		disk_write(i + 1, inode_block.data);
+		memset(&inode_dirty[i * INODES_PER_BLOCK / 8], 0, INODES_PER_BLOCK / 8);
+	}
+	pthread_mutex_unlock(&table_lock);
+}
+
+// Find the data block holding block number block_offset of a file, given its indirect pointers
+int block_lookup(struct fs_inode *inode, union fs_block *indirect_block, int block_offset)
+{
+	if ( block_offset < POINTERS_PER_INODE ) {
+		return inode->direct[block_offset];  // direct inodes
+	}
+	return indirect_block->pointers[block_offset - POINTERS_PER_INODE];  // indirect inodes
+}
+
+// Is a block all zeros.  It is scanned 128 bytes at a time with AVX2 when the CPU has it and with SSE2,
+// which every x86-64 CPU has, otherwise.  Other machines compare a word at a time.
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+bool block_is_zero_avx2(const char *data)
+{
+	const __m256i *p = (const __m256i *) data;
+	__m256i bits;
+	int i;
+
+	for ( i = 0; i < DISK_BLOCK_SIZE / (int) sizeof(__m256i); i += 4 ) {
+		bits = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(p + i), _mm256_loadu_si256(p + i + 1)),
+				_mm256_or_si256(_mm256_loadu_si256(p + i + 2), _mm256_loadu_si256(p + i + 3)));
+		if ( !_mm256_testz_si256(bits, bits) ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool block_is_zero_sse2(const char *data)
+{
+	const __m128i *p = (const __m128i *) data;
+	__m128i bits;
+	int i;
+
+	for ( i = 0; i < DISK_BLOCK_SIZE / (int) sizeof(__m128i); i += 8 ) {
+		bits = _mm_or_si128(_mm_or_si128(_mm_or_si128(_mm_loadu_si128(p + i), _mm_loadu_si128(p + i + 1)),
+				_mm_or_si128(_mm_loadu_si128(p + i + 2), _mm_loadu_si128(p + i + 3))),
+				_mm_or_si128(_mm_or_si128(_mm_loadu_si128(p + i + 4), _mm_loadu_si128(p + i + 5)),
+				_mm_or_si128(_mm_loadu_si128(p + i + 6), _mm_loadu_si128(p + i + 7))));
+		if ( _mm_movemask_epi8(_mm_cmpeq_epi8(bits, _mm_setzero_si128())) != 0xffff ) {
+			return false;
+		}
+	}
+	return true;
+}
+#endif
+
+bool block_is_zero(const char *data)
+{
+#if defined(__x86_64__)
+	if ( __builtin_cpu_supports("avx2") ) {
+		return block_is_zero_avx2(data);
+	}
+	return block_is_zero_sse2(data);
+#else
+	uint64_t word;
+	int i;
+
+	for ( i = 0; i < DISK_BLOCK_SIZE; i += sizeof(word) ) {
+		memcpy(&word, data + i, sizeof(word));
+		if ( word ) {
+			return false;
+		}
+	}
+	return true;
+#endif
+}
+
+void meta_read(int blocknum, char *data);
+
+// Get the indirect pointers of a file into map.  They are kept from the last call and only read again
+// when a different file, or a different indirect block, is asked for, or the file has changed.
+// The caller holds the inode lock.
+union fs_block *blockmap_load(struct fs_blockmap *map, int inumber, struct fs_inode *inode)
+{
+	unsigned long gen = __atomic_load_n(&inode_locks[inumber % INODE_LOCKS].gen, __ATOMIC_ACQUIRE);
+
+	if ( map->inumber != inumber || map->indirect != inode->indirect || map->gen != gen ) {
+		if ( inode->indirect ) {
+			meta_read(inode->indirect, map->pointers.data);
+		} else {
+			memset(map->pointers.data, 0, sizeof(map->pointers));
+		}
+		map->inumber = inumber;
+		map->indirect = inode->indirect;
+		map->gen = gen;
+		map->next_offset = -1;
+		map->window = 0;
+		map->ra_end = 0;
+		map->cluster = -1;
+	}
+	return &map->pointers;
+}
+
+// Note that the block pointers of inumber have changed, so every other map of it is stale.
+// map, the one the change was made through, stays valid if it belongs to inumber and is up to date.
+// The caller holds the inode lock exclusively.
+void blockmap_changed(struct fs_blockmap *map, int inumber)
+{
+	unsigned long gen = __atomic_add_fetch(&inode_clock, 1, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&inode_locks[inumber % INODE_LOCKS].gen, gen, __ATOMIC_RELEASE);
+	if ( map->inumber == inumber ) {
+		map->gen = gen;
+	}
+}
+
+// Forget every kept block map.  A fresh generation for every lock makes maps kept by any thread stale.
+void blockmap_invalidate_all()
+{
+	int i;
+
+	for ( i = 0; i < INODE_LOCKS; i++ ) {
+		inode_locks[i].gen = __atomic_add_fetch(&inode_clock, 1, __ATOMIC_RELAXED);
+	}
+	blockmap.inumber = -1;
+}
+
+// Is a handle open on inumber
+bool file_is_open(int inumber)
+{
+	bool open = false;
+	int i;
+
+	pthread_mutex_lock(&files_lock);
+	for ( i = 0; i < OPEN_FILES && !open; i++ ) {
+		open = files[i] && files[i]->inumber == inumber;
+	}
+	pthread_mutex_unlock(&files_lock);
+	return open;
+}
+
+// Drop every open handle, at unmount
+void files_close_all()
+{
+	int i;
+
+	pthread_mutex_lock(&files_lock);
+	for ( i = 0; i < OPEN_FILES; i++ ) {
+		free(files[i]);
+		files[i] = NULL;
+	}
+	pthread_mutex_unlock(&files_lock);
+}
+
+// Prefetch the next window of a sequentially read file, starting at block first.
+// Blocks already prefetched by an earlier call are skipped.
+void readahead(struct fs_blockmap *map, struct fs_inode *inode, union fs_block *indirect_block, int first)
+{
+	int blocks[READAHEAD_MAX];
+	int start = MAX(first, map->ra_end);
+	int end = MIN(first + map->window, (inode->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE);
+	int n = 0;
+	int i;
+
+	for ( i = start; i < end; i++ ) {
+		blocks[n] = block_lookup(inode, indirect_block, i);
+		if ( blocks[n] > 0 ) {
+			n++;
+		}
+	}
+	if ( n > 0 ) {
+		disk_prefetch(blocks, n);
+		map->ra_end = end;
+	}
+}
+
+// Get a count of valid inodes in the inode table
+int get_inode_cnt()
+{
+	return inode_cnt;
+}
+
+int format_disk(bool full);
+
+// Number of blocks at the start of the disk holding metadata rather than file data
+int metadata_blocks()
+{
+	return 1 + super.ninodeblocks + super.nbitmapblocks + super.njournalblocks;
+}
+
+// Write the pinned superblock straight to the image
+void super_save()
+{
+	union fs_block super_block;
+	struct disk_io io = { 0, super_block.data };
+
+	memset(super_block.data, 0, sizeof(super_block));
+	super_block.super = super;
+	disk_writev(&io, 1);
+}
+
+// Write a free block bitmap to the bitmap blocks of the image
+void freemap_save(struct bitmap *map)
+{
+	union fs_block *blocks = calloc(super.nbitmapblocks, sizeof(union fs_block));
+	struct disk_io *io = malloc(super.nbitmapblocks * sizeof(struct disk_io));
+	int i;
+
+	memcpy(blocks, map->words, map->nwords * sizeof(uint64_t));
+	for ( i = 0; i < super.nbitmapblocks; i++ ) {
+		io[i].blocknum = super.bitmapstart + i;
+		io[i].data = blocks[i].data;
+	}
+	disk_writev(io, super.nbitmapblocks);
+
+	free(io);
+	free(blocks);
+}
+
+// Load the free block bitmap from the bitmap blocks of the image
+void freemap_load(struct bitmap *map)
+{
+	union fs_block *blocks = malloc(super.nbitmapblocks * sizeof(union fs_block));
+	struct disk_io *io = malloc(super.nbitmapblocks * sizeof(struct disk_io));
+	int i;
+
+	for ( i = 0; i < super.nbitmapblocks; i++ ) {
+		io[i].blocknum = super.bitmapstart + i;
+		io[i].data = blocks[i].data;
+	}
+	disk_readv(io, super.nbitmapblocks);
+	memcpy(map->words, blocks, map->nwords * sizeof(uint64_t));
+	bitmap_rebuild(map);
+
+	free(io);
+	free(blocks);
+}
+
+// Order block numbers for qsort
+int compare_int(const void *a, const void *b)
+{
+	return *(const int*)a - *(const int*)b;
+}
+
+// Set up the allocation groups over the free block bitmap and count their free blocks
+void groups_init()
+{
+	int g, w;
+
+	ngroups = (freemap.nbits + GROUP_BLOCKS - 1) / GROUP_BLOCKS;
+	groups = malloc(ngroups * sizeof(struct fs_group));
+	for ( g = 0; g < ngroups; g++ ) {
+		pthread_mutex_init(&groups[g].lock, NULL);
+		groups[g].start = g * GROUP_BLOCKS;
+		groups[g].end = MIN((g + 1) * GROUP_BLOCKS, freemap.nbits);
+		groups[g].cursor = groups[g].start;
+		groups[g].nfree = 0;
+		for ( w = groups[g].start / 64; w < (groups[g].end + 63) / 64; w++ ) {
+			groups[g].nfree += __builtin_popcountll(~freemap.words[w]);
+		}
+	}
+}
+
+void groups_free()
+{
+	int g;
+
+	for ( g = 0; g < ngroups; g++ ) {
+		pthread_mutex_destroy(&groups[g].lock);
+	}
+	free(groups);
+	groups = NULL;
+	ngroups = 0;
+}
+
+// The allocation group of the calling thread, handed out round robin the first time it allocates
+int group_of_thread()
+{
+	if ( thread_group < 0 ) {
+		thread_group = __atomic_fetch_add(&group_clock, 1, __ATOMIC_RELAXED) & 0x7fffffff;
+	}
+	return thread_group % ngroups;
+}
+
+// The group new files with this inode number start in: inode blocks are spread over the groups in turn
+int group_of_inode(int inumber)
+{
+	return (inumber / INODES_PER_BLOCK) % ngroups;
+}
+
+// Reserve a run of up to want free blocks in group g, searching from goal if it lies in the group.
+// The caller holds the group lock.
+int group_reserve(struct fs_group *g, int goal, int want, int *got)
+{
+	int start;
+
+	if ( goal >= g->start && goal < g->end ) {
+		g->cursor = goal;
+	}
+	start = bitmap_find_run_in(&freemap, g->start, g->end, &g->cursor, want, got);
+	if ( start >= 0 ) {
+		bitmap_set_range(&freemap, start, *got);
+		__atomic_sub_fetch(&g->nfree, *got, __ATOMIC_RELAXED);
+	}
+	return start;
+}
+
+// Reserve a run of up to want contiguous free blocks, as close after goal as possible.
+// The start is returned and the length stored in got.
+int find_free_extent(int goal, int want, int *got)
+{
+	struct fs_group *g;
+	int start = -1;
+	int mine = group_of_thread();
+	int i;
+
+	// the goal's group is only used when it is free to take, so writers do not queue behind each other
+	g = &groups[MIN(goal, freemap.nbits - 1) / GROUP_BLOCKS];
+	if ( __atomic_load_n(&g->nfree, __ATOMIC_RELAXED) > 0 && pthread_mutex_trylock(&g->lock) == 0 ) {
+		start = group_reserve(g, goal, want, got);
+		pthread_mutex_unlock(&g->lock);
+	}
+
+	// then the thread's own group, then the others in turn
+	for ( i = 0; i < ngroups && start < 0; i++ ) {
+		g = &groups[(mine + i) % ngroups];
+		if ( __atomic_load_n(&g->nfree, __ATOMIC_RELAXED) == 0 ) {
+			continue;
+		}
+		pthread_mutex_lock(&g->lock);
+		start = group_reserve(g, -1, want, got);
+		pthread_mutex_unlock(&g->lock);
+	}
+	return start;
+}
+
+// Give blocks back to their allocation groups.  The list is sorted so each group is locked once.
+void release_blocks(int *blocks, int n)
+{
+	struct fs_group *g = NULL;
+	int i;
+
+	qsort(blocks, n, sizeof(int), compare_int);
+	for ( i = 0; i < n; i++ ) {
+		if ( g != &groups[blocks[i] / GROUP_BLOCKS] ) {
+			if ( g ) {
+				pthread_mutex_unlock(&g->lock);
+			}
+			g = &groups[blocks[i] / GROUP_BLOCKS];
+			pthread_mutex_lock(&g->lock);
+		}
+		if ( bitmap_test(&freemap, blocks[i]) ) {
+			bitmap_clear(&freemap, blocks[i]);
+			__atomic_add_fetch(&g->nfree, 1, __ATOMIC_RELAXED);
+		}
+	}
+	if ( g ) {
+		pthread_mutex_unlock(&g->lock);
+	}
+}
+
+// Release blocks reserved by find_free_extent that were not used.  A run never crosses a group.
+void release_extent(int start, int len)
+{
+	struct fs_group *g;
+	int i;
+
+	if ( len <= 0 ) {
+		return;
+	}
+	g = &groups[start / GROUP_BLOCKS];
+	pthread_mutex_lock(&g->lock);
+	for (i = start; i < start + len; i++) {
+		bitmap_clear(&freemap, i);
+	}
+	__atomic_add_fetch(&g->nfree, len, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&g->lock);
+}
+
+/*
+The metadata journal.  On images that have one, inode blocks, indirect blocks and free bitmap blocks
+never go straight to their home location.  Indirect blocks written by fs_write wait in memory, and
+JOURNAL_BATCH operations later (or at sync and unmount) one commit gathers them together with the
+dirty inode blocks and the changed bitmap blocks.  The commit writes a descriptor and the blocks to
+the journal in one sequential write, then a commit block with a checksum, and only then checkpoints
+the blocks to their home locations, with disk_sync between the three so each is on the media before
+the next starts.  Each commit starts again at the head of the journal, so the journal always holds
+the newest committed transaction; replaying it at mount is harmless even when it was already
+checkpointed.  A commit is always one transaction: an operation changes at most its inode block and
+its indirect block besides the bitmap, so no more operations are let in between commits than the
+journal has room for.  Blocks freed by fs_delete are only given back at the next commit, so none is
+reused before its release is on disk.
+
+Operations run between journal_begin and journal_end, holding journal_lock shared; a commit takes it
+exclusive, so it always sees the metadata between two operations.  journal_mutex guards the list of
+waiting blocks and freed blocks.
+*/
+struct fs_journal_entry {
+	int blocknum;
+	union fs_block block;
+};
+struct fs_journal_entry *journal_buf;
+int journal_nbuf;
+int journal_maxbuf;
+int *journal_freed;
+int journal_nfreed;
+int journal_maxfreed;
+int journal_ops;
+int journal_started;         // operations let in since the last commit
+int journal_seq;
+uint64_t *bitmap_shadow;     // the free bitmap as last written to its home blocks
+pthread_rwlock_t journal_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void journal_commit();
+
+// Does the mounted image have a journal
+bool journal_enabled()
+{
+	return super.njournalblocks > 0;
+}
+
+// Blocks one transaction can hold, leaving room for the descriptor and commit blocks
+int journal_capacity()
+{
+	return MIN(super.njournalblocks - 2, JOURNAL_DESC_MAX);
+}
+
+// Operations whose metadata one transaction is sure to hold: each changes at most an inode block and
+// an indirect block, and all of them together no more than every bitmap block
+int journal_ops_max()
+{
+	return MAX(1, MIN(JOURNAL_BATCH, (journal_capacity() - super.nbitmapblocks) / 2));
+}
+
+// Start an operation that changes metadata.  Once as many have started as the next commit can hold, this
+// one commits first.  The caller may hold its inode lock, since the operations the commit waits for have
+// taken theirs already.
+void journal_begin()
+{
+	if ( !journal_enabled() ) {
+		return;
+	}
+	pthread_rwlock_rdlock(&journal_lock);
+	while ( __atomic_fetch_add(&journal_started, 1, __ATOMIC_RELAXED) >= journal_ops_max() ) {
+		pthread_rwlock_unlock(&journal_lock);
+		journal_commit();
+		pthread_rwlock_rdlock(&journal_lock);
+	}
+}
+
+// Finish an operation, committing when enough of them have gathered.  No inode lock may be held.
+void journal_end()
+{
+	int ops;
+
+	if ( !journal_enabled() ) {
+		return;
+	}
+	ops = __atomic_add_fetch(&journal_ops, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&journal_lock);
+	if ( ops >= journal_ops_max() ) {
+		journal_commit();
+	}
+}
+
+// Write a metadata block.  With a journal it waits in memory for the next commit.
+void meta_write(int blocknum, const char *data)
+{
+	int old_class;
+	int i;
+
+	if ( !journal_enabled() ) {
+		old_class = disk_class(DISK_CLASS_INDIRECT);
+		disk_write(blocknum, data);
+		disk_class(old_class);
+		return;
+	}
+
+	pthread_mutex_lock(&journal_mutex);
+	for ( i = 0; i < journal_nbuf && journal_buf[i].blocknum != blocknum; i++ ) {
+	}
+	if ( i == journal_nbuf ) {
+		if ( journal_nbuf == journal_maxbuf ) {
+			journal_maxbuf = journal_maxbuf ? journal_maxbuf * 2 : JOURNAL_BATCH;
+			journal_buf = realloc(journal_buf, journal_maxbuf * sizeof(struct fs_journal_entry));
+		}
+		journal_buf[journal_nbuf++].blocknum = blocknum;
+	}
+	memcpy(journal_buf[i].block.data, data, DISK_BLOCK_SIZE);
+	pthread_mutex_unlock(&journal_mutex);
+}
+
+// Read a metadata block, taking the copy waiting for the next commit if there is one
+void meta_read(int blocknum, char *data)
+{
+	int old_class;
+	int i;
+
+	if ( journal_enabled() ) {
+		pthread_mutex_lock(&journal_mutex);
+		for ( i = 0; i < journal_nbuf; i++ ) {
+			if ( journal_buf[i].blocknum == blocknum ) {
+				memcpy(data, journal_buf[i].block.data, DISK_BLOCK_SIZE);
+				pthread_mutex_unlock(&journal_mutex);
+				return;
+			}
+		}
+		pthread_mutex_unlock(&journal_mutex);
+	}
+	old_class = disk_class(DISK_CLASS_INDIRECT);
+	disk_read(blocknum, data);
+	disk_class(old_class);
+}
+
+// Free the blocks of a deleted file.  With a journal they are held back until the next commit,
+// and a waiting copy of any of them is dropped.
+void journal_free(int *blocks, int n)
+{
+	int i, j;
+
+	if ( !journal_enabled() ) {
+		release_blocks(blocks, n);
+		return;
+	}
+
+	pthread_mutex_lock(&journal_mutex);
+	if ( journal_nfreed + n > journal_maxfreed ) {
+		journal_maxfreed = MAX(journal_nfreed + n, journal_maxfreed * 2);
+		journal_freed = realloc(journal_freed, journal_maxfreed * sizeof(int));
+	}
+	for ( i = 0; i < n; i++ ) {
+		journal_freed[journal_nfreed++] = blocks[i];
+		for ( j = 0; j < journal_nbuf; j++ ) {
+			if ( journal_buf[j].blocknum == blocks[i] ) {
+				journal_buf[j] = journal_buf[--journal_nbuf];
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&journal_mutex);
+}
+
+// Checksum of the blocks of a transaction and where they belong
+unsigned int journal_checksum(struct disk_io *io, int n)
+{
+	unsigned int hash = 2166136261u;
+	int i, k;
+
+	for ( i = 0; i < n; i++ ) {
+		hash = (hash ^ io[i].blocknum) * 16777619u;
+		for ( k = 0; k < DISK_BLOCK_SIZE; k++ ) {
+			hash = (hash ^ (unsigned char) io[i].data[k]) * 16777619u;
+		}
+	}
+	return hash;
+}
+
+// Log up to journal_capacity() blocks as one transaction, then write them home
+void journal_transaction(struct disk_io *io, int n)
+{
+	union fs_block desc_block;
+	union fs_block commit_block;
+	struct disk_io *log = malloc((n + 1) * sizeof(struct disk_io));
+	struct disk_io commit_io = { super.journalstart + 1 + n, commit_block.data };
+	int i;
+
+	memset(desc_block.data, 0, sizeof(desc_block));
+	desc_block.desc.magic = JOURNAL_MAGIC;
+	desc_block.desc.sequence = journal_seq;
+	desc_block.desc.nblocks = n;
+	log[0].blocknum = super.journalstart;
+	log[0].data = desc_block.data;
+	for ( i = 0; i < n; i++ ) {
+		desc_block.desc.blocknums[i] = io[i].blocknum;
+		log[i + 1].blocknum = super.journalstart + 1 + i;
+		log[i + 1].data = io[i].data;
+	}
+
+	memset(commit_block.data, 0, sizeof(commit_block));
+	commit_block.commit.magic = JOURNAL_COMMIT;
+	commit_block.commit.sequence = journal_seq;
+	commit_block.commit.nblocks = n;
+	commit_block.commit.checksum = journal_checksum(io, n);
+
+	// The commit block only goes out once the rest of the transaction is on the media, and the blocks
+	// only go home once the commit block is.  They are home before the next commit reuses the journal.
+	disk_writev(log, n + 1);
+	disk_sync();
+	disk_writev(&commit_io, 1);
+	disk_sync();
+	disk_writev(io, n);
+	disk_sync();
+	journal_seq++;
+
+	free(log);
+}
+
+// Commit everything changed since the last commit: waiting blocks, dirty inode blocks and
+// changed bitmap blocks.  journal_begin lets in only as many operations as one transaction can hold.
+void journal_commit()
+{
+	union fs_block *blocks;
+	struct disk_io *io;
+	int words_per_block = BITS_PER_BLOCK / 64;
+	int nwords;
+	int ncopies = 0;
+	int n = 0;
+	int i, j;
+
+	if ( !journal_enabled() ) {
+		return;
+	}
+
+	pthread_rwlock_wrlock(&journal_lock);
+	journal_ops = 0;
+	journal_started = 0;
+
+	// blocks freed since the last commit go back now, so the bitmap written below has them free
+	release_blocks(journal_freed, journal_nfreed);
+	journal_nfreed = 0;
+
+	// count what has changed so the copies below need no more memory than that
+	pthread_mutex_lock(&table_lock);
+	for ( i = 0; i < super.ninodeblocks; i++ ) {
+		ncopies += inode_block_dirty(i);
+	}
+	for ( i = 0; i < super.nbitmapblocks; i++ ) {
+		nwords = MIN(words_per_block, freemap.nwords - (i * words_per_block));
+		ncopies += memcmp(&bitmap_shadow[i * words_per_block], &freemap.words[i * words_per_block], nwords * sizeof(uint64_t)) != 0;
+	}
+	blocks = malloc(ncopies * sizeof(union fs_block));
+	io = malloc((journal_nbuf + ncopies) * sizeof(struct disk_io));
+
+	for ( i = 0; i < journal_nbuf; i++ ) {
+		io[n].blocknum = journal_buf[i].blocknum;
+		io[n++].data = journal_buf[i].block.data;
+	}
+
+	// dirty inode blocks are copied out of the inode table
+	for ( i = 0, j = 0; i < super.ninodeblocks; i++ ) {
+		if ( inode_block_dirty(i) ) {
+			memcpy(blocks[j].inode, &inode_table[i * INODES_PER_BLOCK], sizeof(blocks[j].inode));
+			memset(&inode_dirty[i * INODES_PER_BLOCK / 8], 0, INODES_PER_BLOCK / 8);
+			io[n].blocknum = i + 1;
+			io[n++].data = blocks[j++].data;
+		}
+	}
+	pthread_mutex_unlock(&table_lock);
+
+	// and bitmap blocks that differ from what is at home
+	for ( i = 0; i < super.nbitmapblocks; i++ ) {
+		nwords = MIN(words_per_block, freemap.nwords - (i * words_per_block));
+		if ( !memcmp(&bitmap_shadow[i * words_per_block], &freemap.words[i * words_per_block], nwords * sizeof(uint64_t)) ) {
+			continue;
+		}
+		memcpy(&bitmap_shadow[i * words_per_block], &freemap.words[i * words_per_block], nwords * sizeof(uint64_t));
+		memset(blocks[j].data, 0, sizeof(blocks[j]));
+		memcpy(blocks[j].data, &freemap.words[i * words_per_block], nwords * sizeof(uint64_t));
+		io[n].blocknum = super.bitmapstart + i;
+		io[n++].data = blocks[j++].data;
+	}
+
+	// journal_begin lets in only as many operations as fit, so this is never more than one transaction
+	if ( n > 0 ) {
+		journal_transaction(io, n);
+	}
+
+	// the waiting blocks are home now, so readers can go back to the disk for them
+	pthread_mutex_lock(&journal_mutex);
+	journal_nbuf = 0;
+	pthread_mutex_unlock(&journal_mutex);
+
+	free(io);
+	free(blocks);
+	pthread_rwlock_unlock(&journal_lock);
+}
+
+// Replay the transaction left in the journal, if it was committed in full
+void journal_replay()
+{
+	union fs_block desc_block;
+	union fs_block commit_block;
+	union fs_block *blocks;
+	struct disk_io *io;
+	int n, i;
+
+	journal_seq = 1;
+	disk_read(super.journalstart, desc_block.data);
+	n = desc_block.desc.nblocks;
+	if ( desc_block.desc.magic != JOURNAL_MAGIC || n <= 0 || n > journal_capacity() ) {
+		return;
+	}
+	journal_seq = desc_block.desc.sequence + 1;
+
+	blocks = malloc((n + 1) * sizeof(union fs_block));
+	io = malloc((n + 1) * sizeof(struct disk_io));
+	for ( i = 0; i <= n; i++ ) {
+		io[i].blocknum = super.journalstart + 1 + i;
+		io[i].data = blocks[i].data;
+	}
+	disk_readv(io, n + 1);
+	commit_block = blocks[n];
+
+	// point the logged blocks at their home locations, which are never the superblock or the journal
+	for ( i = 0; i < n; i++ ) {
+		io[i].blocknum = desc_block.desc.blocknums[i];
+		if ( io[i].blocknum <= 0 || io[i].blocknum >= super.nblocks ||
+				(io[i].blocknum >= super.journalstart && io[i].blocknum < super.journalstart + super.njournalblocks) ) {
+			break;
+		}
+	}
+
+	if ( i == n && commit_block.commit.magic == JOURNAL_COMMIT &&
+			commit_block.commit.sequence == desc_block.desc.sequence &&
+			commit_block.commit.nblocks == n && commit_block.commit.checksum == journal_checksum(io, n) ) {
+		disk_writev(io, n);
+		disk_sync();
+		printf("fs_mount: replayed %d journal blocks\n", n);
+	}
+
+	free(io);
+	free(blocks);
+}
+
+// Bring the metadata on disk up to date: commit the journal, or write the dirty inode blocks
+void meta_flush()
+{
+	if ( journal_enabled() ) {
+		journal_commit();
+	} else {
+		inode_flush();
+	}
+}
+
+// Start timing a public call to operation op, and tell the disk layer which operation it works for
+void op_begin(struct fs_op_timer *t, int op)
+{
+	t->op = op;
+	t->caller = disk_caller(op);
+	disk_thread_stats(t->io);
+	t->start = stats_now();
+}
+
+// Charge a finished call, and the bytes it moved, to its operation
+void op_end(struct fs_op_timer *t, long bytes)
+{
+	struct fs_op_stats *s = &op_stats[t->op];
+	struct disk_class_stats io[DISK_CLASSES];
+	long ns = stats_now() - t->start;
+	int i;
+
+	disk_thread_stats(io);
+	for ( i = 0; i < DISK_CLASSES; i++ ) {
+		__atomic_add_fetch(&s->io[i].reads, io[i].reads - t->io[i].reads + helper_io[i].reads, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&s->io[i].writes, io[i].writes - t->io[i].writes + helper_io[i].writes, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&s->io[i].hits, io[i].hits - t->io[i].hits + helper_io[i].hits, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&s->io[i].misses, io[i].misses - t->io[i].misses + helper_io[i].misses, __ATOMIC_RELAXED);
+	}
+	memset(helper_io, 0, sizeof(helper_io));
+
+	__atomic_add_fetch(&s->calls, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->bytes, MAX(bytes, 0), __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->nanoseconds, ns, __ATOMIC_RELAXED);
+	stats_record(&s->latency, ns);
+	disk_caller(t->caller);
+}
+
+const char *fs_op_name(int op)
+{
+	static const char *names[FS_OPS] = {
+		"format", "mount", "unmount", "sync", "check", "create",
+		"delete", "getsize", "read", "read_view", "write", "open", "close"
+	};
+
+	return op >= 0 && op < FS_OPS ? names[op] : "unknown";
+}
+
+// Copy out the statistics of every operation, FS_OPS entries
+void fs_stats(struct fs_op_stats *ops)
+{
+	int i, j;
+
+	memset(ops, 0, FS_OPS * sizeof(struct fs_op_stats));
+	for ( i = 0; i < FS_OPS; i++ ) {
+		ops[i].calls = __atomic_load_n(&op_stats[i].calls, __ATOMIC_RELAXED);
+		ops[i].bytes = __atomic_load_n(&op_stats[i].bytes, __ATOMIC_RELAXED);
+		ops[i].nanoseconds = __atomic_load_n(&op_stats[i].nanoseconds, __ATOMIC_RELAXED);
+		for ( j = 0; j < DISK_CLASSES; j++ ) {
+			ops[i].io[j].reads = __atomic_load_n(&op_stats[i].io[j].reads, __ATOMIC_RELAXED);
+			ops[i].io[j].writes = __atomic_load_n(&op_stats[i].io[j].writes, __ATOMIC_RELAXED);
+			ops[i].io[j].hits = __atomic_load_n(&op_stats[i].io[j].hits, __ATOMIC_RELAXED);
+			ops[i].io[j].misses = __atomic_load_n(&op_stats[i].io[j].misses, __ATOMIC_RELAXED);
+		}
+		stats_add(&ops[i].latency, &op_stats[i].latency);
+	}
+}
+
+// Start the operation statistics over, along with those of the disk layer
+void fs_stats_reset()
+{
+	long *p = (long*) op_stats;   // the stats are nothing but longs
+	size_t i;
+
+	for ( i = 0; i < FS_OPS * sizeof(struct fs_op_stats) / sizeof(long); i++ ) {
+		__atomic_store_n(&p[i], 0, __ATOMIC_RELAXED);
+	}
+	disk_stats_reset();
+}
+
+// Format file system, releasing the old contents through disk_discard
+int fs_format()
+{
+	struct fs_op_timer t;
+	int result;
+
+	op_begin(&t, FS_OP_FORMAT);
+	result = format_disk(false);
+	op_end(&t, 0);
+	return result;
+}
+
+// Format file system, writing zeros over every block
+int fs_format_full()
+{
+	struct fs_op_timer t;
+	int result;
+
+	op_begin(&t, FS_OP_FORMAT);
+	result = format_disk(true);
+	op_end(&t, 0);
+	return result;
+}
+
+int format_disk(bool full)
+{
+	union fs_block super_block;
+	union fs_block empty_block;
+	int i;
+	char validate;
+	int inode_val;
+
+	// don't format if file system has been mounted
+	if ( fs_mounted ) {
+		printf("fs_format: file system already mounted\n");
+		return 0;
+	}
+
+	// There must be room for the superblock and an inode block
+	if ( disk_size() < 2 ) {
+		printf("fs_format: a disk of %d blocks is too small for a file system\n", disk_size());
+		return 0;
+	}
+
+	// Read superblock
+	disk_read(0,super_block.data);
+
+	// Check if the file system has already been formatted and ask to reformat it.
+	if (super_block.super.magic == FS_MAGIC) {
+		printf("This disk has already been formated.\n");
+		printf("Reformatting will erase the contents.\n");
+		printf("Continue? (y/n) > ");
+		scanf("%c", &validate);
+		if (validate != 'y') {
+			printf("fs_format: abort\n");
+			return 0;
+		}
+	}
+
+	memset(empty_block.data, 0, sizeof(empty_block));
+
+	// Set attributes of superblock for the file system
+	super_block.super.magic = FS_MAGIC;
+	super_block.super.nblocks = disk_size();
+	inode_val = ceil(disk_size() / 10);
+	if (inode_val == 0) {
+		inode_val = 1; // create at least 1 inode block
+	}
+	super_block.super.ninodeblocks = inode_val;
+	super_block.super.ninodes = inode_val * INODES_PER_BLOCK;
+
+	// The free block bitmap follows the inode table, one bit per block, unless the disk is too small to hold it
+	super_block.super.bitmapstart = 1 + inode_val;
+	super_block.super.nbitmapblocks = (disk_size() + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+	if ( super_block.super.bitmapstart + super_block.super.nbitmapblocks >= disk_size() ) {
+		super_block.super.bitmapstart = 0;
+		super_block.super.nbitmapblocks = 0;
+	}
+	super_block.super.clean = 1;
+
+	// Then the journal, unless the disk is too small to hold it or it could not hold every bitmap block
+	// and one operation in a transaction
+	super_block.super.journalstart = 1 + inode_val + super_block.super.nbitmapblocks;
+	super_block.super.njournalblocks = MIN(JOURNAL_MAX_BLOCKS, MAX(JOURNAL_MIN_BLOCKS, disk_size() / 64));
+	if ( super_block.super.journalstart + super_block.super.njournalblocks >= disk_size() ||
+			MIN(super_block.super.njournalblocks - 2, JOURNAL_DESC_MAX) < super_block.super.nbitmapblocks + 2 ) {
+		super_block.super.journalstart = 0;
+		super_block.super.njournalblocks = 0;
+	}
+
+	// Save the superblock to the file system
+	disk_write(0, super_block.data);
+
+	// Zero out all other datablocks.  A fast format punches them out of the image
+	// instead; they read back as zeros and fs_write never exposes a block it has not filled.
+	if ( full ) {
+		for ( i = 1; i < disk_size(); i++ ) {
+			disk_write(i, empty_block.data);
+		}
+	} else {
+		disk_discard(1, disk_size() - 1);
+	}
+
+	// Save a bitmap with only the metadata blocks in use
+	super = super_block.super;
+	if ( super.nbitmapblocks > 0 ) {
+		bitmap_init(&freemap, disk_size());
+		bitmap_set_range(&freemap, 0, metadata_blocks());
+		freemap_save(&freemap);
+		bitmap_free(&freemap);
+	}
+
+	return 1;
+}
+
+// Debug function
+void fs_debug()
+{
+	union fs_block super_block;
+	union fs_block inode_block;
+	union fs_block indirect_block;
+	int i, j, k;
+
+	// Bring the inode blocks on disk up to date with the in-memory table.
+	if ( fs_mounted ) {
+		meta_flush();
+	}
+
+	// Read super block for attributes of file system.
+	disk_read(0,super_block.data);
+
+	// Check if the file system has been formatted.
+	printf("superblock:\n");
+	if (super_block.super.magic == FS_MAGIC) {
+		printf("    magic number is valid\n");
+	} else {
+		printf("    magic number is invalid. aborting\n");
+		return;
+	}
+
+	// Print the number of blocks, inode blocks, and inodes.
+	printf("    %d blocks on disk\n",super_block.super.nblocks);
+	printf("    %d inode blocks\n",super_block.super.ninodeblocks);
+	printf("    %d inodes total\n",super_block.super.ninodes);
+	if (super_block.super.nbitmapblocks > 0) {
+		printf("    %d bitmap blocks (%s)\n",super_block.super.nbitmapblocks,
+				super_block.super.clean ? "clean" : "in use");
+	}
+	if (super_block.super.njournalblocks > 0) {
+		printf("    %d journal blocks\n",super_block.super.njournalblocks);
+	}
+
+	// Print information on each valid inode
+	for ( i = 0; i < super_block.super.ninodeblocks; i++ ) {
+		disk_read((i + 1), inode_block.data);
+		for ( j = 0; j < INODES_PER_BLOCK; j++ ) {
+			if ( inode_block.inode[j].isvalid ) {
+				printf("inode %d:\n", ( i * INODES_PER_BLOCK ) + j);
+				printf("    size: %d bytes\n", inode_block.inode[j].size);
+				if ( inode_block.inode[j].isvalid & INODE_COMPRESSED ) {
+					printf("    compressed\n");
+				}
+				if ( inode_block.inode[j].isvalid & INODE_DEDUP ) {
+					printf("    deduplicated\n");
+				}
+				printf("    direct blocks: ");
+				for ( k = 0; k < POINTERS_PER_INODE; k++ ) {
+					if ( inode_block.inode[j].direct[k] > 0 ) {
+						printf("%d ", inode_block.inode[j].direct[k]);  // Printing the number of direct data blocks for a valid inode
+					}
+				}
+				printf("\n");
+				if ( inode_block.inode[j].indirect != 0 ) {
+					printf("    indirect block: %d\n", inode_block.inode[j].indirect);
+					disk_class(DISK_CLASS_INDIRECT);
+					disk_read(inode_block.inode[j].indirect, indirect_block.data);
+					disk_class(DISK_CLASS_META);
+					printf("    indirect data blocks: ");
+					for (k = 0; k < POINTERS_PER_BLOCK; k++ ) {
+						if ( indirect_block.pointers[k] > 0 ) {
+							printf("%d ", indirect_block.pointers[k]);  // Printing the number of indirect data blocks for a valid inode if they exist.
+						}
+					}
+					printf("\n");
+				}
+			}
+		}
+	}
+}
+
+/*
+Deduplicated files.  A data block of an inode created with FS_CREATE_DEDUP is shared with every other such
+file holding the same contents.  Each block written to one is hashed with xxh64 and looked up in an index of
+the blocks written since mount, and a block found there is read back and compared before it is shared.
+These blocks are never written in place: a write puts its data in a new or shared block and lets go of the
+old one, so a block holds what the index says it does for as long as anything points at it.  The number of
+pointers to a block is kept in memory for blocks that are shared or indexed, and is counted again from the
+inode table at mount.  A block is freed when its last pointer goes.
+*/
+
+// A block of the deduplicated files that is shared or indexed.  A block without one has a single pointer.
+struct fs_dedup_entry {
+	int blocknum;
+	int refs;             // pointers to the block
+	bool indexed;         // in the index under hash, so it can be shared
+	uint64_t hash;
+	struct fs_dedup_entry *next;        // in the chain of its block number
+	struct fs_dedup_entry *next_hash;   // in the chain of its hash
+};
+struct fs_dedup_entry **dedup_blocks;
+struct fs_dedup_entry **dedup_hashes;
+int dedup_buckets;
+int dedup_count;
+pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Chain of a block number.  The hashes are well mixed already and are chained by their low bits.
+int dedup_bucket(int blocknum)
+{
+	return (int) (((uint64_t) blocknum * 0x9e3779b97f4a7c15ULL) >> 32) & (dedup_buckets - 1);
+}
+
+// Find the entry of a block.  The caller holds dedup_lock.
+struct fs_dedup_entry *dedup_find(int blocknum)
+{
+	struct fs_dedup_entry *e;
+
+	if ( dedup_buckets == 0 ) {
+		return NULL;
+	}
+	for ( e = dedup_blocks[dedup_bucket(blocknum)]; e && e->blocknum != blocknum; e = e->next ) {
+	}
+	return e;
+}
+
+// Put an entry in the chains it belongs in.  The caller holds dedup_lock.
+void dedup_link(struct fs_dedup_entry *e)
+{
+	int b = dedup_bucket(e->blocknum);
+
+	e->next = dedup_blocks[b];
+	dedup_blocks[b] = e;
+	if ( e->indexed ) {
+		e->next_hash = dedup_hashes[e->hash & (dedup_buckets - 1)];
+		dedup_hashes[e->hash & (dedup_buckets - 1)] = e;
+	}
+}
+
+// Double the number of chains, keeping them shorter than one entry on average.  The caller holds dedup_lock.
+void dedup_grow()
+{
+	struct fs_dedup_entry **old = dedup_blocks;
+	struct fs_dedup_entry *e;
+	struct fs_dedup_entry *next;
+	int nold = dedup_buckets;
+	int i;
+
+	dedup_buckets = nold ? nold * 2 : DEDUP_MIN_BUCKETS;
+	dedup_blocks = calloc(dedup_buckets, sizeof(struct fs_dedup_entry *));
+	free(dedup_hashes);
+	dedup_hashes = calloc(dedup_buckets, sizeof(struct fs_dedup_entry *));
+	for ( i = 0; i < nold; i++ ) {
+		for ( e = old[i]; e; e = next ) {
+			next = e->next;
+			dedup_link(e);
+		}
+	}
+	free(old);
+}
+
+// Add an entry for a block with refs pointers, indexed under hash when indexed is set.  The caller holds dedup_lock.
+void dedup_add(int blocknum, int refs, bool indexed, uint64_t hash)
+{
+	struct fs_dedup_entry *e = malloc(sizeof(struct fs_dedup_entry));
+
+	if ( dedup_count >= dedup_buckets ) {
+		dedup_grow();
+	}
+	e->blocknum = blocknum;
+	e->refs = refs;
+	e->indexed = indexed;
+	e->hash = hash;
+	dedup_link(e);
+	dedup_count++;
+}
+
+// Drop an entry, and its place in the index.  The caller holds dedup_lock.
+void dedup_remove(struct fs_dedup_entry *e)
+{
+	struct fs_dedup_entry **p;
+
+	for ( p = &dedup_blocks[dedup_bucket(e->blocknum)]; *p != e; p = &(*p)->next ) {
+	}
+	*p = e->next;
+	if ( e->indexed ) {
+		for ( p = &dedup_hashes[e->hash & (dedup_buckets - 1)]; *p != e; p = &(*p)->next_hash ) {
+		}
+		*p = e->next_hash;
+	}
+	free(e);
+	dedup_count--;
+}
+
+// Forget every entry, at unmount or before they are counted again
+void dedup_clear()
+{
+	struct fs_dedup_entry *e;
+	struct fs_dedup_entry *next;
+	int i;
+
+	for ( i = 0; i < dedup_buckets; i++ ) {
+		for ( e = dedup_blocks[i]; e; e = next ) {
+			next = e->next;
+			free(e);
+		}
+	}
+	free(dedup_blocks);
+	free(dedup_hashes);
+	dedup_blocks = NULL;
+	dedup_hashes = NULL;
+	dedup_buckets = 0;
+	dedup_count = 0;
+}
+
+// Count one more pointer to a block while loading
+void dedup_count_pointer(int blocknum)
+{
+	struct fs_dedup_entry *e;
+
+	// the scan reports pointers that are off the disk
+	if ( blocknum <= 0 || blocknum >= disk_size() ) {
+		return;
+	}
+	e = dedup_find(blocknum);
+	if ( e ) {
+		e->refs++;
+	} else {
+		dedup_add(blocknum, 1, false, 0);
+	}
+}
+
+// Count the pointers to each block of the deduplicated files from the inode table, keeping only the
+// blocks that are shared.  The index starts out empty.  Runs at mount and check, when nothing else can.
+void dedup_load()
+{
+	union fs_block indirect_block;
+	struct fs_dedup_entry *e;
+	struct fs_dedup_entry *next;
+	int i, k;
+
+	dedup_clear();
+	for ( i = 0; i < super.ninodes; i++ ) {
+		if ( !(inode_table[i].isvalid & INODE_DEDUP) ) {
+			continue;
+		}
+		for ( k = 0; k < POINTERS_PER_INODE; k++ ) {
+			dedup_count_pointer(inode_table[i].direct[k]);
+		}
+		if ( inode_table[i].indirect > 0 && inode_table[i].indirect < disk_size() ) {
+			meta_read(inode_table[i].indirect, indirect_block.data);
+			for ( k = 0; k < POINTERS_PER_BLOCK; k++ ) {
+				dedup_count_pointer(indirect_block.pointers[k]);
+			}
+		}
+	}
+
+	for ( i = 0; i < dedup_buckets; i++ ) {
+		for ( e = dedup_blocks[i]; e; e = next ) {
+			next = e->next;
+			if ( e->refs == 1 ) {
+				dedup_remove(e);
+			}
+		}
+	}
+}
+
+// Find a block holding the same data as a block about to be written, with hash its xxh64, and take a
+// pointer to it.  Returns the block number, or 0 if there is none.  The candidate is read and compared
+// without dedup_lock, then taken only if it is still indexed with that hash, so it was not freed meanwhile.
+int dedup_lookup(uint64_t hash, const char *data)
+{
+	union fs_block candidate;
+	struct fs_dedup_entry *e = NULL;
+	int blocknum = 0;
+
+	pthread_mutex_lock(&dedup_lock);
+	if ( dedup_buckets > 0 ) {
+		for ( e = dedup_hashes[hash & (dedup_buckets - 1)]; e && e->hash != hash; e = e->next_hash ) {
+		}
+	}
+	if ( e ) {
+		blocknum = e->blocknum;
+	}
+	pthread_mutex_unlock(&dedup_lock);
+	if ( !blocknum ) {
+		return 0;
+	}
+
+	disk_read(blocknum, candidate.data);
+	if ( memcmp(candidate.data, data, DISK_BLOCK_SIZE) != 0 ) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&dedup_lock);
+	e = dedup_find(blocknum);
+	if ( e && e->indexed && e->hash == hash ) {
+		e->refs++;
+	} else {
+		blocknum = 0;
+	}
+	pthread_mutex_unlock(&dedup_lock);
+	return blocknum;
+}
+
+// Index a block just written to a deduplicated file, which refs pointers now point at
+void dedup_insert(int blocknum, uint64_t hash, int refs)
+{
+	pthread_mutex_lock(&dedup_lock);
+	dedup_add(blocknum, refs, true, hash);
+	pthread_mutex_unlock(&dedup_lock);
+}
+
+// Let go of one pointer to each of n blocks of deduplicated files.  The blocks left with none are moved to
+// the front of the list and their number returned, for the caller to free.
+int dedup_release(int *blocks, int n)
+{
+	struct fs_dedup_entry *e;
+	int nfree = 0;
+	int i;
+
+	pthread_mutex_lock(&dedup_lock);
+	for ( i = 0; i < n; i++ ) {
+		e = dedup_find(blocks[i]);
+		if ( e && e->refs > 1 ) {
+			e->refs--;
+			if ( e->refs == 1 && !e->indexed ) {
+				dedup_remove(e);
+			}
+			continue;
+		}
+		if ( e ) {
+			dedup_remove(e);
+		}
+		blocks[nfree++] = blocks[i];
+	}
+	pthread_mutex_unlock(&dedup_lock);
+	return nfree;
+}
+
+// Where one block of a write to a deduplicated file goes
+struct fs_dedup_slot {
+	uint64_t hash;
+	int shared;           // a block of the same contents already on the disk, with a pointer taken, or 0
+	int same;             // an earlier block of the write with the same contents, or -1
+	int refs;             // pointers the block gets when it is written, counting the blocks the same as it
+};
+
+// Decide where block i of a write to a deduplicated file goes, given the data of every block of the write
+// and which are zeros.  Returns false if it needs a new block.
+bool dedup_match(struct fs_dedup_slot *slots, struct disk_io *io, bool *zero, int i)
+{
+	int j;
+
+	slots[i].hash = xxh64(io[i].data, DISK_BLOCK_SIZE, 0);
+	slots[i].shared = 0;
+	slots[i].same = -1;
+	slots[i].refs = 1;
+	for ( j = 0; j < i; j++ ) {
+		if ( !zero[j] && !slots[j].shared && slots[j].same < 0 && slots[j].hash == slots[i].hash &&
+				memcmp(io[j].data, io[i].data, DISK_BLOCK_SIZE) == 0 ) {
+			slots[i].same = j;
+			return true;
+		}
+	}
+	slots[i].shared = dedup_lookup(slots[i].hash, io[i].data);
+	return slots[i].shared != 0;
+}
+
+/*
+The block pointer scan rebuilds the free block bitmap from the inode table.  The inode blocks are
+handed out one at a time to a pool of workers, each marking the blocks it finds in a bitmap of its
+own and noting any block it sees twice.  The partial bitmaps are then merged, and a block set in
+more than one of them (or claimed by a file while holding metadata) is cross-linked as well.  A data
+block of a deduplicated file may be claimed by any number of them, so such claims are noted in a
+second bitmap and only a block claimed both that way and by anything else is cross-linked.
+*/
+
+// One scan worker and what it has found so far
+struct scan_worker {
+	pthread_t thread;
+	int *next;            // next inode block to hand out, shared by all workers
+	struct bitmap used;
+	struct bitmap shared; // blocks claimed by deduplicated files
+	int *crosslinks;
+	int ncrosslinks;
+	int maxcrosslinks;
+	int badpointers;
+	struct disk_class_stats io[DISK_CLASSES];   // block traffic of the worker's thread
+	int caller;           // operation the scan works for, for the disk layer's trace
+};
+
+// What a block pointer scan found wrong
+struct scan_report {
+	int *crosslinks;      // sorted, each block listed once
+	int ncrosslinks;
+	int badpointers;      // pointers past the end of the disk
+};
+
+// Record a block seen more than once
+void scan_crosslink(struct scan_worker *w, int block)
+{
+	if ( w->ncrosslinks == w->maxcrosslinks ) {
+		w->maxcrosslinks = w->maxcrosslinks ? w->maxcrosslinks * 2 : 16;
+		w->crosslinks = realloc(w->crosslinks, w->maxcrosslinks * sizeof(int));
+	}
+	w->crosslinks[w->ncrosslinks++] = block;
+}
+
+// Mark a block referenced by a file, as a data block of a deduplicated file if shared is set.
+// Returns false for a pointer that is off the disk.
+bool scan_mark(struct scan_worker *w, int block, bool shared)
+{
+	if ( block < 0 || block >= w->used.nbits ) {
+		w->badpointers++;
+		return false;
+	}
+	if ( bitmap_test(&w->used, block) && !(shared && bitmap_test(&w->shared, block)) ) {
+		scan_crosslink(w, block);
+	}
+	bitmap_set(&w->used, block);
+	if ( shared ) {
+		bitmap_set(&w->shared, block);
+	}
+	return true;
+}
+
+// Read a batch of indirect blocks and mark the data blocks they point to.  shared[i] is set when
+// indirect block i belongs to a deduplicated file.
+void mark_indirect_blocks(struct scan_worker *w, struct disk_io *io, union fs_block *blocks, bool *shared, int n)
+{
+	int old_class = disk_class(DISK_CLASS_INDIRECT);
+	int i, k;
+
+	disk_readv(io, n);
+	disk_class(old_class);
+	for ( i = 0; i < n; i++ ) {
+		for ( k = 0; k < POINTERS_PER_BLOCK; k++ ) {
+			if ( blocks[i].pointers[k] > 0 ) {
+				scan_mark(w, blocks[i].pointers[k], shared[i]);
+			}
+		}
+	}
+}
+
+// Scan worker: take inode blocks until none are left and mark every block their files use
+void *scan_worker_run(void *arg)
+{
+	struct scan_worker *w = arg;
+	union fs_block *indirect_blocks = malloc(MOUNT_BATCH * sizeof(union fs_block));
+	struct disk_io indirect_io[MOUNT_BATCH];
+	bool indirect_shared[MOUNT_BATCH];
+	struct fs_inode *inode;
+	bool shared;
+	int nindirect = 0;
+	int b, i, k;
+
+	disk_caller(w->caller);
+	while ( (b = __atomic_fetch_add(w->next, 1, __ATOMIC_RELAXED)) < super.ninodeblocks ) {
+		for ( i = b * INODES_PER_BLOCK; i < (b + 1) * INODES_PER_BLOCK; i++ ) {
+			inode = &inode_table[i];
+			if ( !inode->isvalid ) {
+				continue;
+			}
+
+			shared = inode->isvalid & INODE_DEDUP;
+			for ( k = 0; k < POINTERS_PER_INODE; k++ ) {
+				if ( inode->direct[k] > 0 ) {
+					scan_mark(w, inode->direct[k], shared);
+				}
+			}
+
+			// queue the indirect block to be read with others.  It belongs to this file alone.
+			if ( inode->indirect != 0 && scan_mark(w, inode->indirect, false) ) {
+				indirect_io[nindirect].blocknum = inode->indirect;
+				indirect_io[nindirect].data = indirect_blocks[nindirect].data;
+				indirect_shared[nindirect] = shared;
+				nindirect++;
+				if ( nindirect == MOUNT_BATCH ) {
+					mark_indirect_blocks(w, indirect_io, indirect_blocks, indirect_shared, nindirect);
+					nindirect = 0;
+				}
+			}
+		}
+	}
+
+	if ( nindirect > 0 ) {
+		mark_indirect_blocks(w, indirect_io, indirect_blocks, indirect_shared, nindirect);
+	}
+
+	free(indirect_blocks);
+	disk_thread_stats(w->io);
+	return NULL;
+}
+
+// Number of scan workers to start for the mounted inode table
+int scan_threads()
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	n = MAX(1, MIN(n, SCAN_MAX_THREADS));
+	return MAX(1, MIN(n, super.ninodeblocks));
+}
+
+// Mark every block referenced by a valid inode in map, which holds the metadata blocks on entry.
+// Cross-linked blocks and bad pointers are returned in report, and the number of problems found.
+int scan_blocks(struct bitmap *map, struct scan_report *report)
+{
+	struct scan_worker *workers;
+	struct bitmap shared;
+	uint64_t overlap;
+	int nworkers = scan_threads();
+	int next = 0;
+	int caller = disk_caller(DISK_TRACE_NONE);
+	int i, j, n;
+
+	disk_caller(caller);
+	workers = calloc(nworkers, sizeof(struct scan_worker));
+	for ( i = 0; i < nworkers; i++ ) {
+		workers[i].next = &next;
+		workers[i].caller = caller;
+		bitmap_init(&workers[i].used, map->nbits);
+		bitmap_init(&workers[i].shared, map->nbits);
+	}
+
+	// run one worker on this thread and the rest alongside it
+	for ( i = 1; i < nworkers; i++ ) {
+		if ( pthread_create(&workers[i].thread, NULL, scan_worker_run, &workers[i]) != 0 ) {
+			break;
+		}
+	}
+	n = i;
+	scan_worker_run(&workers[0]);
+	for ( i = 1; i < n; i++ ) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	// merge the partial maps; a bit already set is a block claimed twice, unless only deduplicated files claim it
+	bitmap_init(&shared, map->nbits);
+	report->crosslinks = NULL;
+	report->ncrosslinks = 0;
+	report->badpointers = 0;
+	for ( i = 0; i < nworkers; i++ ) {
+		for ( j = 0; j < map->nwords; j++ ) {
+			overlap = map->words[j] & workers[i].used.words[j] & ~(shared.words[j] & workers[i].shared.words[j]);
+			while ( overlap ) {
+				// the padding past the last block is busy in every map
+				if ( j * 64 + __builtin_ctzll(overlap) < map->nbits ) {
+					scan_crosslink(&workers[i], j * 64 + __builtin_ctzll(overlap));
+				}
+				overlap &= overlap - 1;
+			}
+			map->words[j] |= workers[i].used.words[j];
+			shared.words[j] |= workers[i].shared.words[j];
+		}
+		if ( workers[i].ncrosslinks > 0 ) {
+			report->crosslinks = realloc(report->crosslinks,
+					(report->ncrosslinks + workers[i].ncrosslinks) * sizeof(int));
+			memcpy(&report->crosslinks[report->ncrosslinks], workers[i].crosslinks,
+					workers[i].ncrosslinks * sizeof(int));
+			report->ncrosslinks += workers[i].ncrosslinks;
+		}
+		report->badpointers += workers[i].badpointers;
+
+		// the first worker ran on this thread, so its traffic is counted already
+		for ( j = 0; i > 0 && j < DISK_CLASSES; j++ ) {
+			helper_io[j].reads += workers[i].io[j].reads;
+			helper_io[j].writes += workers[i].io[j].writes;
+			helper_io[j].hits += workers[i].io[j].hits;
+			helper_io[j].misses += workers[i].io[j].misses;
+		}
+		bitmap_free(&workers[i].used);
+		bitmap_free(&workers[i].shared);
+		free(workers[i].crosslinks);
+	}
+	bitmap_free(&shared);
+	bitmap_rebuild(map);
+	free(workers);
+
+	// a block claimed three times is still one cross-linked block
+	qsort(report->crosslinks, report->ncrosslinks, sizeof(int), compare_int);
+	for ( i = 0, n = 0; i < report->ncrosslinks; i++ ) {
+		if ( n == 0 || report->crosslinks[i] != report->crosslinks[n - 1] ) {
+			report->crosslinks[n++] = report->crosslinks[i];
+		}
+	}
+	report->ncrosslinks = n;
+
+	return report->ncrosslinks + report->badpointers;
+}
+
+// Mount file system
+int mount_disk()
+{
+	union fs_block super_block;
+	struct scan_report report;
+	struct disk_io *io;
+	bool scan;
+
+	int i;
+
+	// make sure there's not already a file system mounted
+	if (fs_mounted ) {
+		printf("fs_mount: file system already mounted\n");
+		return 0;
+	}
+
+	// Read superblock data
+	disk_read(0,super_block.data);
+
+	// make sure a file system exists on the disk
+	if ( super_block.super.magic != FS_MAGIC ) {
+		printf("fs_mount: file system invalid format\n");
+		return 0;
+	}
+
+	// pin the superblock and bring the metadata up to date from the journal
+	super = super_block.super;
+	if ( journal_enabled() && !super.clean ) {
+		journal_replay();
+	}
+
+	// a journal too small for one operation and the whole bitmap (formatted before fs_format checked) is not used
+	if ( journal_enabled() && journal_capacity() < super.nbitmapblocks + 2 ) {
+		printf("fs_mount: journal of %d blocks is too small, running without it\n", super.njournalblocks);
+		super.journalstart = 0;
+		super.njournalblocks = 0;
+	}
+
+	// load the inode table into memory
+	inode_table = (struct fs_inode*) malloc(super.ninodes * sizeof(struct fs_inode));
+	inode_dirty = (unsigned char*) calloc(super.ninodes / 8, sizeof(unsigned char));
+
+	// create our free block bitmap with every block free
+	bitmap_init(&freemap, disk_size());
+	bitmap_init(&inodemap, super.ninodes);
+	inode_cnt = 0;
+	pthread_once(&inode_locks_once, inode_locks_init);
+	blockmap_invalidate_all();
+
+	// After a clean unmount, or after replaying the journal, the bitmap on disk is up to date and the
+	// block pointers need not be scanned.  Otherwise we at least have an occupied super block, some inode
+	// blocks, the bitmap blocks and the journal.
+	scan = !(super.nbitmapblocks > 0 && (super.clean || journal_enabled()));
+	if ( scan ) {
+		bitmap_set_range(&freemap, 0, metadata_blocks());
+	} else {
+		freemap_load(&freemap);
+	}
+
+	// read the whole inode table in one batch
+	io = malloc(super.ninodeblocks * sizeof(struct disk_io));
+	for ( i = 0; i < super.ninodeblocks; i++ ) {
+		io[i].blocknum = i + 1;
+		io[i].data = (char*) &inode_table[i * INODES_PER_BLOCK];
+	}
+	disk_readv(io, super.ninodeblocks);
+	free(io);
+
+	for ( i = 0; i < super.ninodes; i++ ) {
+		if ( inode_table[i].isvalid ) {
+			bitmap_set(&inodemap, i);
+			inode_cnt++;
+		}
+	}
+
+	// figure out direct blocks, indirect blocks, and indirect data blocks of every file
+	if ( scan && scan_blocks(&freemap, &report) > 0 ) {
+		printf("fs_mount: %d cross-linked blocks and %d bad block pointers found, run check\n",
+				report.ncrosslinks, report.badpointers);
+	}
+	if ( scan ) {
+		free(report.crosslinks);
+	}
+
+	// count the pointers to the blocks deduplicated files share
+	dedup_load();
+
+	groups_init();
+
+	// The journal keeps the bitmap on disk current from here, starting from what it holds now
+	if ( journal_enabled() ) {
+		if ( scan ) {
+			freemap_save(&freemap);
+		}
+		bitmap_shadow = malloc(freemap.nwords * sizeof(uint64_t));
+		memcpy(bitmap_shadow, freemap.words, freemap.nwords * sizeof(uint64_t));
+	}
+
+	// The bitmap on disk goes stale from here until a clean unmount.
+	if ( super.nbitmapblocks > 0 ) {
+		super.clean = 0;
+		super_save();
+	}
+
+	fs_mounted = true;
+
+	return 1;
+}
+
+// Check the mounted file system: scan every block pointer again and compare the result with the
+// free block bitmap.  The bitmap is replaced with the scanned one.  Returns the number of problems.
+int check_disk()
+{
+	struct scan_report report;
+	struct bitmap used;
+	uint64_t lost;
+	int problems, leaked = 0;
+	int i;
+
+	if ( !fs_mounted ) {
+		printf("fs_check: no file system mounted\n");
+		return -1;
+	}
+
+	// the scan reads indirect blocks from the disk, so they must be home first
+	meta_flush();
+
+	bitmap_init(&used, freemap.nbits);
+	bitmap_set_range(&used, 0, metadata_blocks());
+	problems = scan_blocks(&used, &report);
+
+	for ( i = 0; i < report.ncrosslinks; i++ ) {
+		printf("fs_check: block %d is claimed more than once\n", report.crosslinks[i]);
+	}
+	if ( report.badpointers > 0 ) {
+		printf("fs_check: %d block pointers are past the end of the disk\n", report.badpointers);
+	}
+
+	// blocks in use but marked free would be handed out again; blocks marked busy but unused are lost space
+	for ( i = 0; i < used.nwords; i++ ) {
+		lost = used.words[i] & ~freemap.words[i];
+		while ( lost ) {
+			printf("fs_check: block %d is in use but marked free\n", i * 64 + __builtin_ctzll(lost));
+			lost &= lost - 1;
+			problems++;
+		}
+		leaked += __builtin_popcountll(freemap.words[i] & ~used.words[i]);
+	}
+	if ( leaked > 0 ) {
+		printf("fs_check: %d blocks are marked busy but not used by any file\n", leaked);
+		problems += leaked;
+	}
+
+	groups_free();
+	bitmap_free(&freemap);
+	freemap = used;
+	groups_init();
+	free(report.crosslinks);
+	dedup_load();
+
+	return problems;
+}
+
+// Write the dirty parts of the inode table back to the disk
+int sync_disk()
+{
+	if ( !fs_mounted ) {
+		printf("fs_sync: no file system mounted\n");
+		return 0;
+	}
+
+	meta_flush();
+	disk_sync();
+
+	return 1;
+}
+
+// Unmount file system
+int unmount_disk()
+{
+	union fs_block empty_block;
+
+	if ( !fs_mounted ) {
+		printf("fs_unmount: no file system mounted\n");
+		return 0;
+	}
+
+	sync_disk();
+
+	// Save the bitmap and mark the image clean so the next mount can skip the scan.
+	if ( super.nbitmapblocks > 0 ) {
+		freemap_save(&freemap);
+		disk_sync();
+		super.clean = 1;
+		super_save();
+		disk_sync();
+	}
+
+	// Everything is home, so the journal is emptied and the next mount has nothing to replay.
+	if ( journal_enabled() ) {
+		memset(empty_block.data, 0, sizeof(empty_block));
+		disk_write(super.journalstart, empty_block.data);
+		disk_sync();
+		free(bitmap_shadow);
+		free(journal_buf);
+		free(journal_freed);
+		bitmap_shadow = NULL;
+		journal_buf = NULL;
+		journal_freed = NULL;
+		journal_maxbuf = journal_maxfreed = 0;
+	}
+
+	files_close_all();
+	free(inode_table);
+	free(inode_dirty);
+	groups_free();
+	dedup_clear();
+	bitmap_free(&freemap);
+	bitmap_free(&inodemap);
+	blockmap_invalidate_all();
+	inode_table = NULL;
+	inode_dirty = NULL;
+
+	fs_mounted = false;
+
+	return 1;
+}
+
+// Create a valid inode
+int create_inode( int flags )
+{
+	struct fs_inode inode;
+	int inumber = -1;
+
+	// Check if the file system has been mounted.
+	if ( !fs_mounted ) {
+		printf("fs_create: can't create inode. no file system mounted\n");
+		return -1;
+	}
+
+	// A compressed cluster is packed into blocks of its own, so it has nothing to share
+	if ( (flags & FS_CREATE_COMPRESSED) && (flags & FS_CREATE_DEDUP) ) {
+		printf("fs_create: can't create inode. a file can't be both compressed and deduplicated\n");
+		return -1;
+	}
+
+	// If the maximum number of inodes have been created then exit
+	pthread_mutex_lock(&table_lock);
+	if (get_inode_cnt() == super.ninodes) {
+		pthread_mutex_unlock(&table_lock);
+		printf("fs_create: can't create inode. inode table is full\n");
+		return -1;
+	}
+
+	// take the lowest free inode slot from the inode map
+	inumber = bitmap_find_free(&inodemap);
+	if (inumber >= 0) {
+		bitmap_set(&inodemap, inumber);
+		inode_cnt++;
+	}
+	pthread_mutex_unlock(&table_lock);
+
+	// and put our new inode there
+	if (inumber >= 0) {
+		memset((char*)&inode, 0, sizeof(inode));
+		inode.isvalid = INODE_VALID | ((flags & FS_CREATE_COMPRESSED) ? INODE_COMPRESSED : 0) |
+				((flags & FS_CREATE_DEDUP) ? INODE_DEDUP : 0);
+		inode.indirect = 0;
+		inode_lock(inumber, true);
+		journal_begin();
+		inode_save(inumber, &inode);
+		blockmap_changed(&blockmap, inumber);
+		inode_unlock(inumber);
+		journal_end();
+	}
+
+	// Return the newly created inode number.
+	return inumber;
+}
+
+// Delete an inode from the file system.  The mode says what happens to the old data blocks:
+// FS_DELETE_FAST leaves them, FS_DELETE_DISCARD punches them out of the image and
+// FS_DELETE_SECURE overwrites them with zeros.
+int delete_inode( int inumber, int mode )
+{
+	struct fs_inode inode;
+	union fs_block indirect_block;
+	union fs_block empty_block;
+	struct disk_io io[POINTERS_PER_INODE + POINTERS_PER_BLOCK + 1];
+	int blocks[POINTERS_PER_INODE + POINTERS_PER_BLOCK + 1];
+	int nblocks = 0;
+	int i, run;
+
+	// validate file system mounted
+	if ( !fs_mounted ) {
+		printf("fs_delete: can't delete inode. no file system mounted\n");
+		return 0;
+	}
+
+	// validate inumber
+	if (inumber < 0 || inumber >= super.ninodes) {
+		printf("fs_delete: can't delete inode. inode number must be less than %d\n",
+				super.ninodes);
+		return 0;
+	}
+
+	// Find the inode and make sure it is a valid inode
+	inode_lock(inumber, true);
+	inode_load(inumber, &inode);
+	if (!inode.isvalid) {
+		inode_unlock(inumber);
+		printf("fs_delete: can't delete inode. inode is not valid. Abort.\n");
+		return 0;
+	}
+	if ( file_is_open(inumber) ) {
+		inode_unlock(inumber);
+		printf("fs_delete: can't delete inode. inode %d is open\n", inumber);
+		return 0;
+	}
+	journal_begin();
+
+	// collect the direct data blocks
+	for (i = 0; i < POINTERS_PER_INODE; i++) {
+		if ( inode.direct[i] > 0 ) {
+			blocks[nblocks++] = inode.direct[i];
+		}
+	}
+
+	// check for indirect data
+	if ( inode.indirect != 0 ) {
+		meta_read(inode.indirect, indirect_block.data);
+
+		// collect the indirect data blocks
+		for (i = 0; i < POINTERS_PER_BLOCK; i++) {
+			if (indirect_block.pointers[i] > 0) {
+				blocks[nblocks++] = indirect_block.pointers[i];
+			}
+		}
+	}
+
+	// a deduplicated file gives up only the data blocks no other file shares
+	if ( inode.isvalid & INODE_DEDUP ) {
+		nblocks = dedup_release(blocks, nblocks);
+	}
+
+	// and the indirect pointers themselves
+	if ( inode.indirect != 0 ) {
+		blocks[nblocks++] = inode.indirect;
+	}
+
+	disk_class(DISK_CLASS_DATA);
+	if ( mode == FS_DELETE_SECURE ) {
+		// overwrite all of the released blocks with empty data in one batch
+		memset(empty_block.data, 0, sizeof(empty_block));
+		for (i = 0; i < nblocks; i++) {
+			io[i].blocknum = blocks[i];
+			io[i].data = empty_block.data;
+		}
+		disk_writev(io, nblocks);
+	} else if ( mode == FS_DELETE_DISCARD ) {
+		// punch out each run of adjacent released blocks
+		qsort(blocks, nblocks, sizeof(int), compare_int);
+		for (i = 0; i < nblocks; i += run) {
+			for (run = 1; i + run < nblocks && blocks[i + run] == blocks[i] + run; run++) {
+			}
+			disk_discard(blocks[i], run);
+		}
+	}
+	disk_class(DISK_CLASS_META);
+
+	// release the blocks only now, so another file cannot be handed one before it is wiped
+	journal_free(blocks, nblocks);
+
+	// delete the inode and save it
+	memset(&inode, 0, sizeof(inode));
+	inode_save(inumber, &inode);
+	blockmap_changed(&blockmap, inumber);
+	inode_unlock(inumber);
+	journal_end();
+
+	// give the slot back so the next create can reuse the lowest free inode
+	pthread_mutex_lock(&table_lock);
+	bitmap_clear(&inodemap, inumber);
+	bitmap_rewind(&inodemap, inumber);
+	inode_cnt--;
+	pthread_mutex_unlock(&table_lock);
+
+	return 1;
+}
+
+// Get the amount of data associated with an inode
+int inode_size( int inumber )
+{
+	struct fs_inode inode;
+
+	// Check if the file system is mounted
+	if (!fs_mounted) {
+		printf("fs_getsize: no file system mounted\n");
+		return -1;
+	}
+
+	// Check if the inode number is in range
+	if (inumber < 0 || inumber >= super.ninodes) {
+		printf("fs_getsize: invalid inode number must be less than %d\n", super.ninodes);
+		return -1;
+	}
+
+	inode_lock(inumber, false);
+	inode_load(inumber, &inode);
+	inode_unlock(inumber);
+
+	// Check if the inode is a valid node for the file system
+	if (!inode.isvalid) {
+		printf("fs_getsize: invalid inode number\n");
+		return -1;
+	}
+
+	// Return the size of the data.
+	return inode.size;
+}
+
+/*
+Compressed files.  The data of an inode created with FS_CREATE_COMPRESSED is kept in clusters of
+CLUSTER_BLOCKS blocks, each compressed with lz_compress as a whole.  A cluster that packs into fewer
+blocks than it covers takes only those, starting with a header giving the compressed length, and the
+pointers of the blocks it does not need are set to CLUSTER_PACKED.  A cluster that does not pack is
+stored as it is, and one of zeros is a hole.  The last cluster the map read or wrote is kept
+decompressed in the block map.
+*/
+
+// Number of block pointers a cluster has, which is short only for the last cluster of the largest file
+int cluster_slots(int cluster)
+{
+	return MIN(CLUSTER_BLOCKS, POINTERS_PER_INODE + POINTERS_PER_BLOCK - cluster * CLUSTER_BLOCKS);
+}
+
+// Is a cluster stored compressed.  Its last pointer is CLUSTER_PACKED if so.
+bool cluster_packed(struct fs_inode *inode, union fs_block *indirect_block, int cluster)
+{
+	return block_lookup(inode, indirect_block, cluster * CLUSTER_BLOCKS + cluster_slots(cluster) - 1) == CLUSTER_PACKED;
+}
+
+// Point block block_offset of a file at blocknum.  The caller makes sure an indirect block is there if needed.
+void block_set(struct fs_inode *inode, union fs_block *indirect_block, int block_offset, int blocknum)
+{
+	if ( block_offset < POINTERS_PER_INODE ) {
+		inode->direct[block_offset] = blocknum;
+	} else {
+		indirect_block->pointers[block_offset - POINTERS_PER_INODE] = blocknum;
+	}
+}
+
+// Get a cluster of a compressed file into map->cluster_data, unless it is there already.  The caller
+// holds the inode lock and has loaded map.
+void cluster_load(struct fs_blockmap *map, struct fs_inode *inode, union fs_block *indirect_block, int cluster)
+{
+	char packed[CLUSTER_BYTES];
+	struct disk_io io[CLUSTER_BLOCKS];
+	int first = cluster * CLUSTER_BLOCKS;
+	int slots = cluster_slots(cluster);
+	int length;
+	int n = 0;
+	int i;
+
+	if ( map->cluster == cluster ) {
+		return;
+	}
+
+	if ( cluster_packed(inode, indirect_block, cluster) ) {
+		// read the blocks holding the compressed cluster and unpack them
+		for ( i = 0; i < slots && block_lookup(inode, indirect_block, first + i) > 0; i++ ) {
+			io[n].blocknum = block_lookup(inode, indirect_block, first + i);
+			io[n].data = packed + (i * DISK_BLOCK_SIZE);
+			n++;
+		}
+		disk_readv(io, n);
+		memcpy(&length, packed, sizeof(int));
+		if ( n == 0 || length <= 0 || length > (n * DISK_BLOCK_SIZE) - (int) sizeof(int) ) {
+			length = -1;
+		} else {
+			length = lz_decompress(packed + sizeof(int), length, map->cluster_data, slots * DISK_BLOCK_SIZE);
+		}
+		if ( length < 0 ) {
+			printf("fs_read: compressed cluster %d of %d blocks is damaged\n", cluster, n);
+			length = 0;
+		}
+		memset(map->cluster_data + length, 0, (slots * DISK_BLOCK_SIZE) - length);
+	} else {
+		// a cluster stored as it is is read like any other blocks, and its holes are zeros
+		for ( i = 0; i < slots; i++ ) {
+			io[n].blocknum = block_lookup(inode, indirect_block, first + i);
+			io[n].data = map->cluster_data + (i * DISK_BLOCK_SIZE);
+			if ( io[n].blocknum > 0 ) {
+				n++;
+			} else {
+				memset(map->cluster_data + (i * DISK_BLOCK_SIZE), 0, DISK_BLOCK_SIZE);
+			}
+		}
+		disk_readv(io, n);
+	}
+	map->cluster = cluster;
+}
+
+// Read from a compressed file a cluster at a time.  The range has been checked against the file size.
+void read_clusters(struct fs_blockmap *map, struct fs_inode *inode, union fs_block *indirect_block, char *data, int length, int offset)
+{
+	int cluster;
+	int start;
+	int end;
+
+	for ( cluster = offset / CLUSTER_BYTES; cluster <= (offset + length - 1) / CLUSTER_BYTES; cluster++ ) {
+		start = MAX(offset, cluster * CLUSTER_BYTES);
+		end = MIN(offset + length, (cluster + 1) * CLUSTER_BYTES);
+		cluster_load(map, inode, indirect_block, cluster);
+		memcpy(data + start - offset, map->cluster_data + start - (cluster * CLUSTER_BYTES), end - start);
+	}
+}
+
+// Take n free blocks, in as few runs as possible starting at goal.  Returns the number taken, which is
+// less than n only when the disk is full.
+int alloc_blocks(int goal, int n, int *blocks)
+{
+	int got = 0;
+	int start;
+	int len;
+
+	while ( got < n ) {
+		start = find_free_extent(goal, n - got, &len);
+		if ( start < 0 ) {
+			break;
+		}
+		while ( len-- > 0 ) {
+			blocks[got++] = start++;
+		}
+		goal = start;
+	}
+	return got;
+}
+
+// Write to a compressed file a cluster at a time.  Each cluster the write touches is brought up to date in
+// map->cluster_data, packed again and written to new blocks; its old blocks are freed with journal_free.
+// Writing over them would leave the old pointers, still the ones on disk until the next commit, pointing
+// at contents packed for the new ones.  The caller holds the inode lock exclusively and has called
+// journal_begin.
+int write_clusters(struct fs_blockmap *map, int inumber, struct fs_inode *inode, union fs_block *indirect_block, const char *data, int length, int offset)
+{
+	char packed[CLUSTER_BYTES];
+	struct disk_io io[CLUSTER_BLOCKS];
+	int old_blocks[CLUSTER_BLOCKS];
+	int new_blocks[CLUSTER_BLOCKS + 1];
+	int bytes_written = 0;
+	int cluster;
+	int first;
+	int slots;
+	int start;
+	int end;
+	int used;
+	int packed_length;
+	int nold;
+	int nnew;
+	int want;
+	int got;
+	int goal;
+	int blocknum;
+	int i;
+	bool zero;
+	bool need_indirect;
+	bool indirect_dirty = false;
+	char *source;
+
+	// New blocks go right after the block before them in the file, and a new file starts in the group of its inode
+	goal = groups[group_of_inode(inumber)].start;
+
+	for ( cluster = offset / CLUSTER_BYTES; cluster <= (offset + length - 1) / CLUSTER_BYTES; cluster++ ) {
+		first = cluster * CLUSTER_BLOCKS;
+		slots = cluster_slots(cluster);
+		start = MAX(offset, cluster * CLUSTER_BYTES);
+		end = MIN(offset + length, (cluster + 1) * CLUSTER_BYTES);
+
+		// The old contents are only needed where the write leaves some of the cluster as it was.
+		// Whatever is past the old end of the file must read back as zeros once the size grows over it.
+		if ( start > cluster * CLUSTER_BYTES || end < MIN((cluster + 1) * CLUSTER_BYTES, MAX(inode->size, end)) ) {
+			disk_class(DISK_CLASS_DATA);
+			cluster_load(map, inode, indirect_block, cluster);
+			disk_class(DISK_CLASS_META);
+			if ( inode->size < (cluster + 1) * CLUSTER_BYTES ) {
+				i = MAX(inode->size - (cluster * CLUSTER_BYTES), 0);
+				memset(map->cluster_data + i, 0, CLUSTER_BYTES - i);
+			}
+		} else if ( inode->size < (cluster + 1) * CLUSTER_BYTES ) {
+			memset(map->cluster_data, 0, CLUSTER_BYTES);
+		}
+		map->cluster = cluster;
+		memcpy(map->cluster_data + start - (cluster * CLUSTER_BYTES), data + start - offset, end - start);
+
+		// The cluster covers the blocks up to the end of the file.  Pack it into fewer blocks if it will go.
+		used = MIN(slots, (MAX(inode->size, end) - (cluster * CLUSTER_BYTES) + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE);
+		zero = true;
+		for ( i = 0; i < used && zero; i++ ) {
+			zero = block_is_zero(map->cluster_data + (i * DISK_BLOCK_SIZE));
+		}
+		packed_length = 0;
+		if ( zero ) {
+			want = 0;
+			source = NULL;
+		} else if ( used > 1 && (packed_length = lz_compress(map->cluster_data, used * DISK_BLOCK_SIZE,
+				packed + sizeof(int), ((used - 1) * DISK_BLOCK_SIZE) - sizeof(int))) > 0 ) {
+			memcpy(packed, &packed_length, sizeof(int));
+			want = (packed_length + sizeof(int) + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+			source = packed;
+		} else {
+			want = used;
+			source = map->cluster_data;
+		}
+
+		// The cluster goes to new blocks near the ones it had
+		nold = 0;
+		for ( i = 0; i < slots; i++ ) {
+			if ( block_lookup(inode, indirect_block, first + i) > 0 ) {
+				old_blocks[nold++] = block_lookup(inode, indirect_block, first + i);
+			}
+		}
+		need_indirect = !inode->indirect && want > 0 && first + (packed_length > 0 ? slots : want) - 1 >= POINTERS_PER_INODE;
+		if ( nold > 0 ) {
+			goal = old_blocks[nold - 1] + 1;
+		} else if ( first > 0 && block_lookup(inode, indirect_block, first - 1) > 0 ) {
+			goal = block_lookup(inode, indirect_block, first - 1) + 1;
+		}
+		nnew = want + (need_indirect ? 1 : 0);
+		got = alloc_blocks(goal, nnew, new_blocks);
+		if ( got < nnew ) {
+			printf("fs_write: disk is full\n");
+			release_blocks(new_blocks, got);
+			map->cluster = -1;
+			break;
+		}
+		if ( nnew > 0 ) {
+			goal = new_blocks[nnew - 1] + 1;
+		}
+
+		// If there isn't an indirect block created, then create one ahead of the data
+		if ( need_indirect ) {
+			inode->indirect = new_blocks[--nnew];
+			memset(indirect_block->data, 0, sizeof(*indirect_block));
+			map->indirect = inode->indirect;
+		}
+
+		// point the cluster at its blocks and write them in one batch
+		for ( i = 0; i < slots; i++ ) {
+			if ( i < want ) {
+				blocknum = new_blocks[i];
+				io[i].blocknum = blocknum;
+				io[i].data = source + (i * DISK_BLOCK_SIZE);
+			} else {
+				blocknum = packed_length > 0 ? CLUSTER_PACKED : 0;
+			}
+			if ( block_lookup(inode, indirect_block, first + i) != blocknum ) {
+				block_set(inode, indirect_block, first + i, blocknum);
+				indirect_dirty = indirect_dirty || first + i >= POINTERS_PER_INODE;
+			}
+		}
+		disk_class(DISK_CLASS_DATA);
+		disk_writev(io, want);
+		disk_class(DISK_CLASS_META);
+
+		// the old blocks are freed once nothing on disk points at them
+		if ( nold > 0 ) {
+			journal_free(old_blocks, nold);
+		}
+
+		bytes_written = end - offset;
+	}
+
+	// An indirect block left with no pointers is given back, otherwise it is written once for the whole call
+	if ( indirect_dirty && inode->indirect && block_is_zero(indirect_block->data) ) {
+		journal_free(&inode->indirect, 1);
+		inode->indirect = 0;
+		map->indirect = 0;
+	} else if ( indirect_dirty && inode->indirect ) {
+		meta_write(inode->indirect, indirect_block->data);
+	}
+
+	// Keep track of the inode size and write the meta data to the file system.  The cluster this map
+	// holds decompressed stays valid; every other map of the file is made stale.
+	if ( offset + bytes_written > inode->size ) {
+		inode->size = offset + bytes_written;
+	}
+	inode_save(inumber, inode);
+	blockmap_changed(map, inumber);
+	return bytes_written;
+}
+
+// Read from a valid inode through map, following up with read-ahead.  The caller holds the inode lock.
+int read_data(struct fs_blockmap *map, int inumber, struct fs_inode *inode, char *data, int length, int offset)
+{
+	union fs_block *indirect_block;
+	union fs_block head_block;
+	union fs_block tail_block;
+	struct disk_io *io;
+	int block_offset;
+	int byte_offset;
+	int nblocks;
+	int start;
+	int n = 0;
+	int i;
+	bool head_used = false;
+	bool tail_used = false;
+
+	// return here if the offset doesn't make sense
+	if ( offset < 0 || offset >= inode->size || length <= 0 ) {
+		return 0;
+	}
+
+	// make sure we don't try to read past the end of the inode
+	if (inode->size < offset + length ) {
+		length = inode->size - offset;
+	}
+
+	// translate starting offset to block terms
+	block_offset = offset / DISK_BLOCK_SIZE;
+	byte_offset = offset % DISK_BLOCK_SIZE;
+	nblocks = (byte_offset + length + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+
+	// look up the indirect pointers, which are kept between calls
+	indirect_block = blockmap_load(map, inumber, inode);
+
+	disk_class(DISK_CLASS_DATA);
+	if ( inode->isvalid & INODE_COMPRESSED ) {
+		read_clusters(map, inode, indirect_block, data, length, offset);
+	} else {
+		// whole blocks are read straight into the output buffer, partial blocks at either end through a bounce
+		// block, and a hole has no block behind it and reads back as zeros
+		io = malloc(nblocks * sizeof(struct disk_io));
+		for ( i = 0; i < nblocks; i++ ) {
+			start = (i * DISK_BLOCK_SIZE) - byte_offset;
+			io[n].blocknum = block_lookup(inode, indirect_block, block_offset + i);
+			if ( start >= 0 && start + DISK_BLOCK_SIZE <= length ) {
+				io[n].data = data + start;
+			} else if ( i == 0 ) {
+				io[n].data = head_block.data;
+				head_used = true;
+			} else {
+				io[n].data = tail_block.data;
+				tail_used = true;
+			}
+			if ( io[n].blocknum ) {
+				n++;
+			} else {
+				memset(io[n].data, 0, DISK_BLOCK_SIZE);
+			}
+		}
+		disk_readv(io, n);
+
+		// copy the partial blocks into the output buffer
+		if ( head_used ) {
+			memcpy(data, head_block.data + byte_offset, MIN(DISK_BLOCK_SIZE - byte_offset, length));
+		}
+		if ( tail_used ) {
+			start = ((nblocks - 1) * DISK_BLOCK_SIZE) - byte_offset;
+			memcpy(data + start, tail_block.data, length - start);
+		}
+		free(io);
+	}
+
+	// read ahead when this read starts the file or carries on where the last one stopped
+	if ( offset == 0 || offset == map->next_offset ) {
+		map->window = map->window ? MIN(map->window * 2, READAHEAD_MAX) : READAHEAD_MIN;
+		readahead(map, inode, indirect_block, block_offset + nblocks);
+	} else {
+		map->window = 0;
+		map->ra_end = 0;
+	}
+	map->next_offset = offset + length;
+	disk_class(DISK_CLASS_META);
+
+	return length;
+}
+
+// read data from the file system
+int read_file( int inumber, char *data, int length, int offset )
+{
+	struct fs_inode inode;
+	int bytes_read;
+
+	// Check if the file system is mounted
+	if (!fs_mounted) {
+		printf("fs_read: no file system mounted\n");
+		return 0;
+	}
+
+
+	// Check is the inode value is less than the max number of inodes possible in the file system.
+	if (inumber < 0 || inumber >= super.ninodes ) {
+		printf("fs_read: invalid inode number must be less than %d\n",
+				super.ninodes);
+		return 0;
+	}
+
+	inode_lock(inumber, false);
+	inode_load(inumber, &inode);
+
+	// Check that the inode is valid.
+	if (!inode.isvalid) {
+		inode_unlock(inumber);
+		printf("fs_read: no inode data present for inode %d\n", inumber);
+		return 0;
+	}
+
+	bytes_read = read_data(&blockmap, inumber, &inode, data, length, offset);
+	inode_unlock(inumber);
+
+	return bytes_read;
+}
+
+// Zeros standing in for a hole in a view
+const union fs_block zero_block;
+
+// Get a read-only view of file data at offset straight from the disk mapping.
+// The view covers the run of contiguous blocks starting at offset, and sees later writes to them.  Returns the number
+// of bytes in the view, 0 at the end of the file, or -1 if the disk cannot hand out views or the file is compressed.
+int read_view( int inumber, int offset, const char **view )
+{
+	struct fs_inode inode;
+	union fs_block *indirect_block;
+	const char *first;
+	int block_offset;
+	int byte_offset;
+	int last_block;
+	int nblocks;
+
+	// Check if the file system is mounted
+	if (!fs_mounted) {
+		printf("fs_read_view: no file system mounted\n");
+		return 0;
+	}
+
+	// Check is the inode value is less than the max number of inodes possible in the file system.
+	if (inumber < 0 || inumber >= super.ninodes ) {
+		printf("fs_read_view: invalid inode number must be less than %d\n",
+				super.ninodes);
+		return 0;
+	}
+
+	inode_lock(inumber, false);
+	inode_load(inumber, &inode);
+
+	// Check that the inode is valid.
+	if (!inode.isvalid) {
+		inode_unlock(inumber);
+		printf("fs_read_view: no inode data present for inode %d\n", inumber);
+		return 0;
+	}
+
+	if ( offset < 0 || offset >= inode.size ) {
+		inode_unlock(inumber);
+		return 0;
+	}
+
+	// the blocks of a compressed file do not hold its data as it reads
+	if ( inode.isvalid & INODE_COMPRESSED ) {
+		inode_unlock(inumber);
+		return -1;
+	}
+
+	block_offset = offset / DISK_BLOCK_SIZE;
+	byte_offset = offset % DISK_BLOCK_SIZE;
+	last_block = (inode.size - 1) / DISK_BLOCK_SIZE;
+
+	indirect_block = blockmap_load(&blockmap, inumber, &inode);
+
+	// a hole is viewed as zeros, one block at a time
+	if ( !block_lookup(&inode, indirect_block, block_offset) ) {
+		inode_unlock(inumber);
+		*view = zero_block.data + byte_offset;
+		return MIN(DISK_BLOCK_SIZE - byte_offset, inode.size - offset);
+	}
+
+	disk_class(DISK_CLASS_DATA);
+	first = disk_block_ptr(block_lookup(&inode, indirect_block, block_offset));
+	if ( !first ) {
+		disk_class(DISK_CLASS_META);
+		inode_unlock(inumber);
+		return -1;
+	}
+
+	// extend the view over the following blocks while they sit right after it on disk
+	nblocks = 1;
+	while ( block_offset + nblocks <= last_block && nblocks < VIEW_MAX_BLOCKS ) {
+		if ( !block_lookup(&inode, indirect_block, block_offset + nblocks)
+				|| disk_block_ptr(block_lookup(&inode, indirect_block, block_offset + nblocks))
+				!= first + ((size_t)nblocks * DISK_BLOCK_SIZE) ) {
+			break;
+		}
+		nblocks++;
+	}
+	disk_advise(block_lookup(&inode, indirect_block, block_offset), nblocks, DISK_ADVISE_SEQUENTIAL);
+	disk_class(DISK_CLASS_META);
+	inode_unlock(inumber);
+
+	*view = first + byte_offset;
+	return MIN((nblocks * DISK_BLOCK_SIZE) - byte_offset, inode.size - offset);
+}
+
+// Write to a valid inode through map at offset.  Blocks the file already has are overwritten in place and
+// only holes, and blocks past the end, get new blocks.  A block that would hold nothing but zeros is left
+// as a hole, or made into one.  A deduplicated file instead points each block at one holding the same data
+// or at a new block, and lets go of the old one.  The caller holds the inode lock exclusively and has called
+// journal_begin; it calls journal_end once the lock is dropped.  inode is updated and saved.
+int write_data(struct fs_blockmap *map, int inumber, struct fs_inode *inode, const char *data, int length, int offset)
+{
+	union fs_block *indirect_block;
+	union fs_block head_block;
+	union fs_block tail_block;
+	struct disk_io edges[2];
+	int nedges = 0;
+	int first_block;
+	int last_block;
+	int last_data = -1;
+	int byte_offset;
+	int end_bytes;
+	bool head_partial;
+	bool tail_partial;
+	bool *zero;
+	int *punched;
+	int npunched = 0;
+	int nfreed;
+	bool dedup = inode->isvalid & INODE_DEDUP;
+	struct fs_dedup_slot *slots = NULL;
+	int block_offset;
+	int new_block;
+	bool need_indirect;
+	int bytes_written = 0;
+	int blocks_needed = 0;
+	int run_start = 0;
+	int run_len = 0;
+	int goal;
+	bool indirect_dirty = false;
+	bool changed = false;
+	struct disk_io *io;
+	int nio = 0;
+	int i;
+
+	// return here if the offset doesn't make sense
+	if ( offset < 0 ) {
+		printf("fs_write: offset must not be negative\n");
+		return 0;
+	}
+	if ( length <= 0 ) {
+		return 0;
+	}
+
+	// The inode can only address the direct blocks and one indirect block of pointers.
+	if ( (long)offset + length > (long)(POINTERS_PER_INODE + POINTERS_PER_BLOCK) * DISK_BLOCK_SIZE ) {
+		printf("fs_write: file is too large\n");
+		if ( offset >= (POINTERS_PER_INODE + POINTERS_PER_BLOCK) * DISK_BLOCK_SIZE ) {
+			return 0;
+		}
+		length = (POINTERS_PER_INODE + POINTERS_PER_BLOCK) * DISK_BLOCK_SIZE - offset;
+	}
+
+	// translate the range to block terms.  The indirect pointers come from the kept block map.
+	indirect_block = blockmap_load(map, inumber, inode);
+	if ( inode->isvalid & INODE_COMPRESSED ) {
+		return write_clusters(map, inumber, inode, indirect_block, data, length, offset);
+	}
+	first_block = offset / DISK_BLOCK_SIZE;
+	last_block = (offset + length - 1) / DISK_BLOCK_SIZE;
+	byte_offset = offset % DISK_BLOCK_SIZE;
+	end_bytes = (offset + length) % DISK_BLOCK_SIZE;
+	head_partial = byte_offset > 0 || (first_block == last_block && end_bytes > 0);
+	tail_partial = first_block != last_block && end_bytes > 0;
+
+	// A block written in part keeps the rest of its old contents, so only the blocks at either end are read.
+	// A hole has nothing to read and starts out as zeros.
+	if ( head_partial ) {
+		edges[nedges].blocknum = block_lookup(inode, indirect_block, first_block);
+		edges[nedges].data = head_block.data;
+		if ( edges[nedges].blocknum ) {
+			nedges++;
+		} else {
+			memset(head_block.data, 0, sizeof(head_block));
+		}
+	}
+	if ( tail_partial ) {
+		edges[nedges].blocknum = block_lookup(inode, indirect_block, last_block);
+		edges[nedges].data = tail_block.data;
+		if ( edges[nedges].blocknum ) {
+			nedges++;
+		} else {
+			memset(tail_block.data, 0, sizeof(tail_block));
+		}
+	}
+	disk_class(DISK_CLASS_DATA);
+	disk_readv(edges, nedges);
+	disk_class(DISK_CLASS_META);
+
+	// Whatever is past the old end of the file must read back as zeros once the size grows over it
+	if ( head_partial ) {
+		if ( first_block == inode->size / DISK_BLOCK_SIZE ) {
+			memset(head_block.data + inode->size % DISK_BLOCK_SIZE, 0, DISK_BLOCK_SIZE - inode->size % DISK_BLOCK_SIZE);
+		}
+		memcpy(head_block.data + byte_offset, data, MIN(DISK_BLOCK_SIZE - byte_offset, length));
+	}
+	if ( tail_partial ) {
+		if ( last_block == inode->size / DISK_BLOCK_SIZE ) {
+			memset(tail_block.data + inode->size % DISK_BLOCK_SIZE, 0, DISK_BLOCK_SIZE - inode->size % DISK_BLOCK_SIZE);
+		}
+		memcpy(tail_block.data, data + length - end_bytes, end_bytes);
+	}
+
+	// Find what each block will hold: whole blocks come from the input buffer, partial blocks at either end
+	// from their bounce block.  Count the holes that get data, including a new indirect block, so they can
+	// be reserved as one run.  Every block of a deduplicated file that matches no other needs one.
+	io = malloc((last_block - first_block + 1) * sizeof(struct disk_io));
+	zero = malloc((last_block - first_block + 1) * sizeof(bool));
+	punched = malloc((last_block - first_block + 2) * sizeof(int));
+	if ( dedup ) {
+		slots = malloc((last_block - first_block + 1) * sizeof(struct fs_dedup_slot));
+	}
+	disk_class(DISK_CLASS_DATA);
+	for ( i = 0; i <= last_block - first_block; i++ ) {
+		if ( i == 0 && head_partial ) {
+			io[i].data = head_block.data;
+		} else if ( i == last_block - first_block && tail_partial ) {
+			io[i].data = tail_block.data;
+		} else {
+			io[i].data = (char*) data + ((first_block + i) * DISK_BLOCK_SIZE) - offset;
+		}
+		zero[i] = block_is_zero(io[i].data);
+		if ( zero[i] ) {
+			continue;
+		}
+		last_data = first_block + i;
+		if ( dedup ) {
+			if ( !dedup_match(slots, io, zero, i) ) {
+				blocks_needed++;
+			}
+		} else if ( !block_lookup(inode, indirect_block, first_block + i) ) {
+			blocks_needed++;
+		}
+	}
+	disk_class(DISK_CLASS_META);
+	if ( !inode->indirect && last_data >= POINTERS_PER_INODE ) {
+		blocks_needed++;
+	}
+
+	// New blocks go right after the block before them in the file, and a new file starts in the group of its inode
+	goal = groups[group_of_inode(inumber)].start;
+
+	// Write while there are blocks to write
+	block_offset = first_block;
+	while ( block_offset <= last_block ) {
+
+		int write_block = block_lookup(inode, indirect_block, block_offset);
+		char *block_data = io[block_offset - first_block].data;
+
+		// A block of zeros needs no block behind it.  One the file already has is given back.
+		if ( zero[block_offset - first_block] ) {
+			if ( write_block ) {
+				punched[npunched++] = write_block;
+				if (block_offset < POINTERS_PER_INODE ) {
+					inode->direct[block_offset] = 0;
+				} else {
+					indirect_block->pointers[block_offset - POINTERS_PER_INODE] = 0;
+					indirect_dirty = true;
+				}
+				changed = true;
+			}
+			bytes_written = MIN((block_offset + 1) * DISK_BLOCK_SIZE - offset, length);
+			block_offset++;
+			continue;
+		}
+
+		// The data goes to the block the file has, unless it is deduplicated and goes to a block holding
+		// the same data, or to a new one
+		if ( dedup && slots[block_offset - first_block].same >= 0 ) {
+			new_block = block_lookup(inode, indirect_block, first_block + slots[block_offset - first_block].same);
+		} else if ( dedup ) {
+			new_block = slots[block_offset - first_block].shared;
+		} else {
+			new_block = write_block;
+		}
+		need_indirect = block_offset >= POINTERS_PER_INODE && !inode->indirect;
+
+		// A block that needs one takes the next block of a contiguous run reserved for the rest of the write.
+		if ( (!new_block || need_indirect) && run_len == 0 ) {
+			if ( block_offset > 0 && block_lookup(inode, indirect_block, block_offset - 1) ) {
+				goal = block_lookup(inode, indirect_block, block_offset - 1) + 1;
+			}
+			run_start = find_free_extent(goal, blocks_needed, &run_len);
+
+			// If there are no more free blocks the disk is full.
+			if (run_start < 0) {
+				printf("fs_write: disk is full\n");
+				run_len = 0;
+				break;
+			}
+			goal = run_start + run_len;
+		}
+
+		if ( need_indirect ) {
+			// If there isn't an indirect block created, then create one in the run ahead of its data
+			inode->indirect = run_start++;
+			run_len--;
+			blocks_needed--;
+			memset(indirect_block->data, 0, sizeof(*indirect_block));
+			map->indirect = inode->indirect;
+			indirect_dirty = true;
+			changed = true;
+			continue;
+		}
+
+		if ( dedup && slots[block_offset - first_block].same >= 0 ) {
+			slots[slots[block_offset - first_block].same].refs++;
+		}
+		if ( !new_block ) {
+			new_block = run_start++;
+			run_len--;
+			blocks_needed--;
+
+			// the list is packed down over the blocks left as holes or shared
+			io[nio].blocknum = new_block;
+			io[nio++].data = block_data;
+		} else if ( !dedup ) {
+			io[nio].blocknum = new_block;
+			io[nio++].data = block_data;
+		}
+
+		// A deduplicated file lets go of the block it had, even when it points at it again
+		if ( dedup && write_block ) {
+			punched[npunched++] = write_block;
+		}
+		if ( new_block != write_block ) {
+			if (block_offset < POINTERS_PER_INODE ) {
+				inode->direct[block_offset] = new_block;
+			} else { // Now fill indirect inodes
+				indirect_block->pointers[block_offset - POINTERS_PER_INODE] = new_block;
+				indirect_dirty = true;
+			}
+			changed = true;
+		}
+
+		bytes_written = MIN((block_offset + 1) * DISK_BLOCK_SIZE - offset, length);  // Track the number of bytes written to data blocks.
+
+		block_offset++;
+	}
+
+	// Give back any part of the reserved run that was not used, and the blocks that were to be shared
+	// after the disk filled up.
+	release_extent(run_start, run_len);
+	for ( i = block_offset - first_block; dedup && i <= last_block - first_block; i++ ) {
+		if ( !zero[i] && slots[i].shared ) {
+			punched[npunched++] = slots[i].shared;
+		}
+	}
+	nfreed = dedup ? dedup_release(punched, npunched) : npunched;
+
+	// Start writing the data to the blocks chosen in one batch
+	disk_class(DISK_CLASS_DATA);
+	disk_submit_writev(io, nio);
+	disk_class(DISK_CLASS_META);
+
+	// An indirect block left with no pointers is given back too
+	if ( indirect_dirty && npunched > 0 && block_is_zero(indirect_block->data) ) {
+		punched[nfreed++] = inode->indirect;
+		inode->indirect = 0;
+		map->indirect = 0;
+		indirect_dirty = false;
+	}
+
+	// Write the block numbers which will be used for indirect data, once for the whole call
+	if (indirect_dirty) {
+		meta_write(inode->indirect, indirect_block->data);
+	}
+
+	// Wait for the data before the inode points at it, or another file can share it
+	disk_complete();
+	for ( i = 0; dedup && i < block_offset - first_block; i++ ) {
+		if ( !zero[i] && !slots[i].shared && slots[i].same < 0 ) {
+			dedup_insert(block_lookup(inode, indirect_block, first_block + i), slots[i].hash, slots[i].refs);
+		}
+	}
+	free(io);
+	free(zero);
+	free(slots);
+
+	// Blocks that became holes are freed once nothing points at them
+	if ( nfreed > 0 ) {
+		journal_free(punched, nfreed);
+	}
+	free(punched);
+
+	// Keep track of the inode size and write the meta data to the file system.  Overwriting blocks
+	// inside the file changes neither, so it costs only the data blocks.
+	if ( offset + bytes_written > inode->size ) {
+		inode->size = offset + bytes_written;
+		changed = true;
+	}
+	if ( changed ) {
+		inode_save(inumber, inode);
+		blockmap_changed(map, inumber);
+	}
+	return bytes_written;
+}
+
+// Write data to the file system.
+int write_file( int inumber, const char *data, int length, int offset )
+{
+	struct fs_inode inode;
+	int bytes_written;
+
+	// Check if the file system is mounted.
+	if (!fs_mounted) {
+		printf("fs_write: no file system mounted\n");
+		return 0;
+	}
+
+
+	// Check that the inode requested is less than the max number of inodes in the file system.
+	if (inumber < 0 || inumber >= super.ninodes ) {
+		printf("fs_write: invalid inode number must be less than %d\n",
+				super.ninodes);
+		return 0;
+	}
+
+	inode_lock(inumber, true);
+	inode_load(inumber, &inode);
+
+	// Check that the inode is a valid inode
+	if (!inode.isvalid) {
+		inode_unlock(inumber);
+		printf("fs_write: no inode data present for inode %d\n", inumber);
+		return 0;
+	}
+	journal_begin();
+	bytes_written = write_data(&blockmap, inumber, &inode, data, length, offset);
+	inode_unlock(inumber);
+	journal_end();
+	return bytes_written;
+}
+
+// Open a handle on a valid inode, with its cursor at the start of the file
+int open_file( int inumber )
+{
+	struct fs_file *f;
+	int fd;
+
+	if (!fs_mounted) {
+		printf("fs_open: no file system mounted\n");
+		return -1;
+	}
+
+	if (inumber < 0 || inumber >= super.ninodes ) {
+		printf("fs_open: invalid inode number must be less than %d\n", super.ninodes);
+		return -1;
+	}
+
+	f = calloc(1, sizeof(struct fs_file));
+	f->inumber = inumber;
+	f->map.inumber = -1;
+
+	// the pinned copy is as new as the lock generation read with it
+	inode_lock(inumber, false);
+	f->map.gen = __atomic_load_n(&inode_locks[inumber % INODE_LOCKS].gen, __ATOMIC_ACQUIRE);
+	inode_load(inumber, &f->inode);
+	if (!f->inode.isvalid) {
+		inode_unlock(inumber);
+		free(f);
+		printf("fs_open: no inode data present for inode %d\n", inumber);
+		return -1;
+	}
+
+	pthread_mutex_lock(&files_lock);
+	for ( fd = 0; fd < OPEN_FILES && files[fd]; fd++ ) {
+	}
+	if ( fd < OPEN_FILES ) {
+		files[fd] = f;
+	}
+	pthread_mutex_unlock(&files_lock);
+	inode_unlock(inumber);
+
+	if ( fd == OPEN_FILES ) {
+		free(f);
+		printf("fs_open: too many open files\n");
+		return -1;
+	}
+	return fd;
+}
+
+// Find the file behind a handle
+struct fs_file *file_get( int fd, const char *caller )
+{
+	if ( !fs_mounted ) {
+		printf("%s: no file system mounted\n", caller);
+		return NULL;
+	}
+	if ( fd < 0 || fd >= OPEN_FILES || !files[fd] ) {
+		printf("%s: bad file handle %d\n", caller, fd);
+		return NULL;
+	}
+	return files[fd];
+}
+
+// Bring the pinned inode up to date if the file was changed other than through this handle.
+// The caller holds the inode lock.
+void file_refresh( struct fs_file *f )
+{
+	if ( f->map.gen != __atomic_load_n(&inode_locks[f->inumber % INODE_LOCKS].gen, __ATOMIC_ACQUIRE) ) {
+		inode_load(f->inumber, &f->inode);
+	}
+}
+
+// Close a handle, writing back the metadata changed through it
+int close_file( int fd )
+{
+	struct fs_file *f = file_get(fd, "fs_close");
+
+	if ( !f ) {
+		return 0;
+	}
+
+	if ( f->written ) {
+		meta_flush();
+	}
+
+	pthread_mutex_lock(&files_lock);
+	files[fd] = NULL;
+	pthread_mutex_unlock(&files_lock);
+	free(f);
+
+	return 1;
+}
+
+// Read from the cursor of a handle and move it past what was read
+int fread_file( int fd, char *data, int length )
+{
+	struct fs_file *f = file_get(fd, "fs_fread");
+	int bytes_read;
+
+	if ( !f ) {
+		return 0;
+	}
+
+	inode_lock(f->inumber, false);
+	file_refresh(f);
+	bytes_read = read_data(&f->map, f->inumber, &f->inode, data, length, f->offset);
+	inode_unlock(f->inumber);
+
+	f->offset += bytes_read;
+	return bytes_read;
+}
+
+// Write at the cursor of a handle and move it past what was written
+int fwrite_file( int fd, const char *data, int length )
+{
+	struct fs_file *f = file_get(fd, "fs_fwrite");
+	int bytes_written;
+
+	if ( !f ) {
+		return 0;
+	}
+
+	inode_lock(f->inumber, true);
+	file_refresh(f);
+	journal_begin();
+	bytes_written = write_data(&f->map, f->inumber, &f->inode, data, length, f->offset);
+	inode_unlock(f->inumber);
+	journal_end();
+
+	f->offset += bytes_written;
+	f->written = true;
+	return bytes_written;
+}
+
+// Move the cursor of a handle.  Returns the new offset, or -1.
+int seek_file( int fd, int offset )
+{
+	struct fs_file *f = file_get(fd, "fs_seek");
+
+	if ( !f ) {
+		return -1;
+	}
+	if ( offset < 0 ) {
+		printf("fs_seek: offset must not be negative\n");
+		return -1;
+	}
+
+	f->offset = offset;
+	return offset;
+}
+
+/*
+The public calls.  Each one is timed and counted in op_stats around the function doing the work.
+*/
+
+int fs_mount()
+{
+	struct fs_op_timer t;
+	int result;
+
+	op_begin(&t, FS_OP_MOUNT);
+	result = mount_disk();
+	op_end(&t, 0);
+	return result;
+}
+
+int fs_unmount()
+{
+	struct fs_op_timer t;
+	int result;
+
+	op_begin(&t, FS_OP_UNMOUNT);
+	result = unmount_disk();
+	op_end(&t, 0);
+	return result;
+}
+
+int fs_sync()
+{
+	struct fs_op_timer t;
+	int result;
+
+	op_begin(&t, FS_OP_SYNC);
+	result = sync_disk();
+	op_end(&t, 0);
+	return result;
+}
+
+int fs_check()
+{
+	struct fs_op_timer t;
+	int result;
+
+	op_begin(&t, FS_OP_CHECK);
+	result = check_disk();
+	op_end(&t, 0);
+	return result;
+}
+
+int fs_create()
+{
+	return fs_create_mode(0);
+}
+
+// Create an inode with the given FS_CREATE_ flags
+int fs_create_mode( int flags )
+{
+	struct fs_op_timer t;
+	int result;
+
+	op_begin(&t, FS_OP_CREATE);
+	result = create_inode(flags);
+	op_end(&t, 0);
+	return result;
+}
+
+// Delete an inode from the file system, leaving its old data blocks as they are
+int fs_delete( int inumber )
+{
+	return fs_delete_mode(inumber, FS_DELETE_FAST);
+}
+
+int fs_delete_mode( int inumber, int mode )
+{
+	struct fs_op_timer t;
+	int result;
+
+	op_begin(&t, FS_OP_DELETE);
+	result = delete_inode(inumber, mode);
+	op_end(&t, 0);
+	return result;
+}
+
+int fs_getsize( int inumber )
+{
+	struct fs_op_timer t;
+	int result;
+
+	op_begin(&t, FS_OP_GETSIZE);
+	result = inode_size(inumber);
+	op_end(&t, 0);
+	return result;
+}
+
+int fs_read( int inumber, char *data, int length, int offset )
+{
+	struct fs_op_timer t;
+	int result;
+
+	op_begin(&t, FS_OP_READ);
+	result = read_file(inumber, data, length, offset);
+	op_end(&t, result);
+	return result;
+}
+
+int fs_read_view( int inumber, int offset, const char **view )
+{
+	struct fs_op_timer t;
+	int result;
+
+	op_begin(&t, FS_OP_READ_VIEW);
+	result = read_view(inumber, offset, view);
+	op_end(&t, result);
+	return result;
+}
+
+int fs_write( int inumber, const char *data, int length, int offset )
+{
+	struct fs_op_timer t;
+	int result;
+
+	op_begin(&t, FS_OP_WRITE);
+	result = write_file(inumber, data, length, offset);
+	op_end(&t, result);
+	return result;
+}
+
+int fs_open( int inumber )
+{
+	struct fs_op_timer t;
+	int result;
+
+	op_begin(&t, FS_OP_OPEN);
+	result = open_file(inumber);
+	op_end(&t, 0);
+	return result;
+}
+
+int fs_close( int fd )
+{
+	struct fs_op_timer t;
+	int result;
+
+	op_begin(&t, FS_OP_CLOSE);
+	result = close_file(fd);
+	op_end(&t, 0);
+	return result;
+}
+
+int fs_fread( int fd, char *data, int length )
+{
+	struct fs_op_timer t;
+	int result;
+
+	op_begin(&t, FS_OP_READ);
+	result = fread_file(fd, data, length);
+	op_end(&t, result);
+	return result;
+}
+
+int fs_fwrite( int fd, const char *data, int length )
+{
+	struct fs_op_timer t;
+	int result;
+
+	op_begin(&t, FS_OP_WRITE);
+	result = fwrite_file(fd, data, length);
+	op_end(&t, result);
+	return result;
+}
+
+// Moving the cursor does no I/O, so it is not counted
+int fs_seek( int fd, int offset )
+{
+	return seek_file(fd, offset);
+}
@@ -1,15 +1,69 @@
-#ifndef FS_H
-#define FS_H
-
-void fs_debug();
-int  fs_format();
-int  fs_mount();
-
-int  fs_create();
-int  fs_delete( int inumber );
-int  fs_getsize();
-
-int  fs_read( int inumber, char *data, int length, int offset );
-int  fs_write( int inumber, const char *data, int length, int offset );
-
+#ifndef FS_H
+#define FS_H
+
+#include "disk.h"
+
+// flags of fs_create_mode
+#define FS_CREATE_COMPRESSED 1   // store the data in compressed clusters
+#define FS_CREATE_DEDUP      2   // share data blocks with other such files holding the same data
+
+// what fs_delete_mode does with the data blocks of a deleted inode
+#define FS_DELETE_FAST    0
+#define FS_DELETE_DISCARD 1
+#define FS_DELETE_SECURE  2
+
+// operations counted by fs_stats
+#define FS_OP_FORMAT    0
+#define FS_OP_MOUNT     1
+#define FS_OP_UNMOUNT   2
+#define FS_OP_SYNC      3
+#define FS_OP_CHECK     4
+#define FS_OP_CREATE    5
+#define FS_OP_DELETE    6
+#define FS_OP_GETSIZE   7
+#define FS_OP_READ      8
+#define FS_OP_READ_VIEW 9
+#define FS_OP_WRITE     10
+#define FS_OP_OPEN      11
+#define FS_OP_CLOSE     12
+#define FS_OPS          13
+
+// calls to one operation and the block traffic they caused, since the last fs_stats_reset
+struct fs_op_stats {
+	long calls;
+	long bytes;          // moved by the read and write calls
+	long nanoseconds;
+	struct disk_class_stats io[DISK_CLASSES];
+	struct stats_histogram latency;
+};
+
+void fs_debug();
+int  fs_format();
+int  fs_format_full();
+int  fs_mount();
+int  fs_unmount();
+int  fs_sync();
+int  fs_check();
+
+int  fs_create();
+int  fs_create_mode( int flags );
+int  fs_delete( int inumber );
+int  fs_delete_mode( int inumber, int mode );
+int  fs_getsize();
+
+int  fs_read( int inumber, char *data, int length, int offset );
+int  fs_read_view( int inumber, int offset, const char **view );
+int  fs_write( int inumber, const char *data, int length, int offset );
+
+// handles with a file cursor; reads and writes through them are counted as fs_read and fs_write
+int  fs_open( int inumber );
+int  fs_close( int fd );
+int  fs_fread( int fd, char *data, int length );
+int  fs_fwrite( int fd, const char *data, int length );
+int  fs_seek( int fd, int offset );
+
+const char * fs_op_name( int op );
+void fs_stats( struct fs_op_stats *ops );
+void fs_stats_reset();
+
 #endif
\ No newline at end of file
@@ -0,0 +1,193 @@
+/*
+
+csci5103_project3
+
+File Systems
+
+Bryan Baker - bake1358@umn.edu
+Alice Anderegg - and08613@umn.edu
+Hailin Archer - deak0007@umn.edu
+
+*/
+
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+static uint32_t read32( const unsigned char *p )
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static int hash32( uint32_t v )
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Write a length that did not fit in its half of the token as a run of bytes
+static unsigned char *put_length( unsigned char *op, int len )
+{
+	while ( len >= 255 ) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+// Write one sequence: literals, then a match unless offset is 0.  Returns NULL if it does not fit.
+static unsigned char *put_sequence( unsigned char *op, unsigned char *end, const unsigned char *literals,
+		int nliterals, int offset, int len )
+{
+	unsigned char *token = op++;
+	int mlen = len - LZ_MIN_MATCH;
+
+	// the worst case for the length bytes, so the checks below can be done once
+	if ( op + nliterals + nliterals / 255 + 1 + (offset ? 3 + mlen / 255 : 0) > end ) {
+		return NULL;
+	}
+
+	*token = (nliterals < 15 ? nliterals : 15) << 4;
+	if ( nliterals >= 15 ) {
+		op = put_length(op, nliterals - 15);
+	}
+	memcpy(op, literals, nliterals);
+	op += nliterals;
+
+	if ( offset ) {
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+		*token |= mlen < 15 ? mlen : 15;
+		if ( mlen >= 15 ) {
+			op = put_length(op, mlen - 15);
+		}
+	}
+	return op;
+}
+
+// Compress n bytes into at most max bytes.  Returns the compressed length, or 0 if it would not fit.
+int lz_compress( const char *in, int n, char *out, int max )
+{
+	const unsigned char *src = (const unsigned char *) in;
+	unsigned char *op = (unsigned char *) out;
+	unsigned char *end = op + max;
+	int table[1 << LZ_HASH_BITS];
+	int i = 0, anchor = 0;
+	int h, match, len;
+
+	if ( n <= 0 || n > LZ_MAX_INPUT ) {
+		return 0;
+	}
+	memset(table, -1, sizeof(table));
+
+	while ( i + LZ_MIN_MATCH <= n ) {
+		h = hash32(read32(src + i));
+		match = table[h];
+		table[h] = i;
+
+		if ( match < 0 || read32(src + match) != read32(src + i) ) {
+			// step further the longer nothing has matched, so incompressible data is passed over quickly
+			i += 1 + ((i - anchor) >> 5);
+			continue;
+		}
+
+		len = LZ_MIN_MATCH;
+		while ( i + len < n && src[match + len] == src[i + len] ) {
+			len++;
+		}
+
+		op = put_sequence(op, end, src + anchor, i - anchor, i - match, len);
+		if ( !op ) {
+			return 0;
+		}
+		i += len;
+		anchor = i;
+	}
+
+	// whatever is left goes out as literals
+	op = put_sequence(op, end, src + anchor, n - anchor, 0, 0);
+	if ( !op ) {
+		return 0;
+	}
+	return op - (unsigned char *) out;
+}
+
+// Get a length continued in the bytes after a token, or -1 if the input ends first
+static int get_length( const unsigned char **ip, const unsigned char *end, int len )
+{
+	int b;
+
+	do {
+		if ( *ip >= end ) {
+			return -1;
+		}
+		b = *(*ip)++;
+		len += b;
+	} while ( b == 255 );
+	return len;
+}
+
+// Decompress n bytes into at most max bytes.  Returns the decompressed length, or -1 if the input is damaged.
+int lz_decompress( const char *in, int n, char *out, int max )
+{
+	const unsigned char *ip = (const unsigned char *) in;
+	const unsigned char *end = ip + n;
+	unsigned char *op = (unsigned char *) out;
+	unsigned char *op_end = op + max;
+	const unsigned char *match;
+	int token, len, offset;
+
+	while ( ip < end ) {
+		token = *ip++;
+
+		len = token >> 4;
+		if ( len == 15 && (len = get_length(&ip, end, len)) < 0 ) {
+			return -1;
+		}
+		if ( len > end - ip || len > op_end - op ) {
+			return -1;
+		}
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		// the last sequence has no match
+		if ( ip == end ) {
+			break;
+		}
+
+		if ( end - ip < 2 ) {
+			return -1;
+		}
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if ( offset == 0 || offset > op - (unsigned char *) out ) {
+			return -1;
+		}
+
+		len = token & 15;
+		if ( len == 15 && (len = get_length(&ip, end, len)) < 0 ) {
+			return -1;
+		}
+		len += LZ_MIN_MATCH;
+		if ( len > op_end - op ) {
+			return -1;
+		}
+
+		// a match may overlap the bytes it produces, so it is copied forwards
+		match = op - offset;
+		if ( offset >= len ) {
+			memcpy(op, match, len);
+			op += len;
+		} else {
+			while ( len-- > 0 ) {
+				*op++ = *match++;
+			}
+		}
+	}
+	return op - (unsigned char *) out;
+}
@@ -0,0 +1,20 @@
+#ifndef LZ_H
+#define LZ_H
+
+/*
+A small LZ77 codec for compressing file data.  The stream is a list of
+sequences, each a token byte (literal count in the high four bits, match
+length less LZ_MIN_MATCH in the low four, with 15 meaning more length bytes
+follow), the literals, and a two byte offset back to the match.  The last
+sequence has literals only.  Matches are found through a hash of the next
+four bytes, so input is limited to 64KB.
+*/
+
+#define LZ_MIN_MATCH  4
+#define LZ_HASH_BITS  12
+#define LZ_MAX_INPUT  65536
+
+int lz_compress( const char *in, int n, char *out, int max );
+int lz_decompress( const char *in, int n, char *out, int max );
+
+#endif
@@ -0,0 +1,241 @@
+/*
+simplefs_replay: play a block I/O trace recorded with disk_trace_start (or
+the shell's trace command) back against an image.
+
+Each recorded call is issued again through the disk layer with the same
+blocks, so cache, backend and read-ahead changes can be compared on a real
+workload.  Written blocks are filled with zeros, so the image should be a
+scratch copy.  Calls go out as fast as possible, or with -t at the times
+they were recorded.  At the end the time taken by the calls of each
+recorded fs_* operation and the disk layer's own statistics are printed.
+*/
+
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REPLAY_CALLERS (FS_OPS+1)   // every fs_* operation, then calls made outside one
+
+struct call {
+	int op;
+	int caller;
+	uint64_t time;
+	int nblocks;
+	int nruns;
+	int maxruns;
+	struct disk_trace_record *runs;
+};
+
+static char block[DISK_BLOCK_SIZE];
+static struct disk_io *io = 0;
+static int *blocknums = 0;
+static int maxblocks = 0;
+static int image_blocks;
+
+static struct stats_histogram latency[REPLAY_CALLERS];
+static long caller_calls[REPLAY_CALLERS];
+static long caller_blocks[REPLAY_CALLERS];
+
+// Make room for a list of n blocks
+static void reserve_blocks( int n )
+{
+	if(n<=maxblocks) return;
+	maxblocks = n>maxblocks*2 ? n : maxblocks*2;
+	io = realloc(io,sizeof(*io)*maxblocks);
+	blocknums = realloc(blocknums,sizeof(*blocknums)*maxblocks);
+	if(!io || !blocknums) {
+		fprintf(stderr,"out of memory\n");
+		exit(1);
+	}
+}
+
+// Wait until time nanoseconds after start
+static void wait_until( long start, uint64_t time )
+{
+	struct timespec ts;
+	long delay = start+(long)time-stats_now();
+
+	if(delay<=0) return;
+	ts.tv_sec = delay/1000000000L;
+	ts.tv_nsec = delay%1000000000L;
+	while(nanosleep(&ts,&ts)<0 && errno==EINTR) {}
+}
+
+// Issue one recorded call again
+static void replay_call( struct call *c )
+{
+	struct disk_trace_record *r;
+	long start;
+	int i, j, n = 0;
+	int slot = c->caller<FS_OPS ? c->caller : FS_OPS;
+
+	reserve_blocks(c->nblocks);
+	for(i=0;i<c->nruns;i++) {
+		r = &c->runs[i];
+		for(j=0;j<r->nblocks;j++) {
+			io[n].blocknum = blocknums[n] = r->blocknum+j;
+			io[n].data = block;
+			n++;
+		}
+	}
+
+	start = stats_now();
+	switch(c->op) {
+		case DISK_TRACE_READ:
+			for(i=0;i<n;i++) disk_read(blocknums[i],block);
+			break;
+		case DISK_TRACE_WRITE:
+			for(i=0;i<n;i++) disk_write(blocknums[i],block);
+			break;
+		case DISK_TRACE_READV:
+			disk_readv(io,n);
+			break;
+		case DISK_TRACE_WRITEV:
+			disk_writev(io,n);
+			break;
+		case DISK_TRACE_PREFETCH:
+			disk_prefetch(blocknums,n);
+			break;
+		case DISK_TRACE_DISCARD:
+			for(i=0;i<c->nruns;i++) disk_discard(c->runs[i].blocknum,c->runs[i].nblocks);
+			break;
+		case DISK_TRACE_SYNC:
+			disk_sync();
+			break;
+	}
+	stats_record(&latency[slot],stats_now()-start);
+	caller_calls[slot]++;
+	caller_blocks[slot] += c->op==DISK_TRACE_SYNC ? 0 : n;
+}
+
+// Add a record to the call being gathered.  Records naming blocks off the image are dropped.
+static void add_run( struct call *c, struct disk_trace_record *r )
+{
+	if(r->blocknum<0 || r->blocknum+r->nblocks>image_blocks) {
+		fprintf(stderr,"skipping blocks %d to %d, past the end of the image\n",r->blocknum,r->blocknum+r->nblocks-1);
+		return;
+	}
+	if(c->nruns==c->maxruns) {
+		c->maxruns = c->maxruns ? c->maxruns*2 : 64;
+		c->runs = realloc(c->runs,sizeof(*c->runs)*c->maxruns);
+		if(!c->runs) {
+			fprintf(stderr,"out of memory\n");
+			exit(1);
+		}
+	}
+	c->runs[c->nruns++] = *r;
+	c->nblocks += r->nblocks;
+}
+
+int main( int argc, char *argv[] )
+{
+	struct disk_trace_header h;
+	struct disk_trace_record r;
+	struct call c;
+	struct disk_stats d;
+	int backend = DISK_BACKEND_PREAD;
+	int timed = 0, cache = -1;
+	long start, ncalls = 0, nblocks = 0;
+	long hits, misses;
+	int reads, writes;
+	double seconds;
+	FILE *trace;
+	int opt, i;
+
+	while((opt=getopt(argc,argv,"tb:c:"))!=-1) {
+		switch(opt) {
+			case 't': timed = 1; break;
+			case 'c': cache = atoi(optarg); break;
+			case 'b':
+				if(!strcmp(optarg,"mmap")) backend = DISK_BACKEND_MMAP;
+				else if(!strcmp(optarg,"uring")) backend = DISK_BACKEND_URING;
+				else if(strcmp(optarg,"pread")) goto usage;
+				break;
+			default: goto usage;
+		}
+	}
+	if(argc-optind!=2) goto usage;
+
+	trace = fopen(argv[optind],"rb");
+	if(!trace) {
+		fprintf(stderr,"couldn't open %s: %s\n",argv[optind],strerror(errno));
+		return 1;
+	}
+	if(fread(&h,sizeof(h),1,trace)!=1 || h.magic!=DISK_TRACE_MAGIC || h.version!=DISK_TRACE_VERSION) {
+		fprintf(stderr,"%s is not a block trace\n",argv[optind]);
+		return 1;
+	}
+
+	image_blocks = h.nblocks;
+	if(!disk_init_backend(argv[optind+1],image_blocks,backend)) {
+		fprintf(stderr,"couldn't initialize %s: %s\n",argv[optind+1],strerror(errno));
+		return 1;
+	}
+	if(cache>=0) disk_cache_size(cache);
+
+	// a record without DISK_TRACE_MORE starts a new call, so the one gathered so far goes out first
+	memset(&c,0,sizeof(c));
+	c.op = -1;
+	start = stats_now();
+	while(1) {
+		i = fread(&r,sizeof(r),1,trace);
+		if(c.op>=0 && (i!=1 || !(r.op & DISK_TRACE_MORE))) {
+			if(timed) wait_until(start,c.time);
+			if(c.nruns>0 || c.op==DISK_TRACE_SYNC) {
+				replay_call(&c);
+				ncalls++;
+				nblocks += c.op==DISK_TRACE_SYNC ? 0 : c.nblocks;
+			}
+			c.op = -1;
+		}
+		if(i!=1) break;
+
+		if(!(r.op & DISK_TRACE_MORE)) {
+			c.op = r.op;
+			c.caller = r.caller;
+			c.time = r.time;
+			c.nruns = 0;
+			c.nblocks = 0;
+		}
+		if(c.op>=0 && c.op!=DISK_TRACE_SYNC) add_run(&c,&r);
+	}
+	seconds = (stats_now()-start)/1e9;
+	fclose(trace);
+
+	disk_counts(&reads,&writes);
+	disk_stats(&d);
+
+	printf("replayed %ld calls naming %ld blocks in %.3f s (%.1f calls/s)\n",ncalls,nblocks,seconds,ncalls/seconds);
+	printf("%d disk block reads, %d disk block writes\n",reads,writes);
+	printf("%-10s %9s %10s %10s %10s\n","operation","calls","blocks","p50 us","p99 us");
+	for(i=0;i<REPLAY_CALLERS;i++) {
+		if(!caller_calls[i]) continue;
+		printf("%-10s %9ld %10ld %10.1f %10.1f\n",i<FS_OPS ? fs_op_name(i) : "(none)",caller_calls[i],caller_blocks[i],
+			stats_percentile(&latency[i],50)/1000.0,stats_percentile(&latency[i],99)/1000.0);
+	}
+	// the replay names no block classes, so everything was counted as metadata
+	hits = d.classes[DISK_CLASS_META].hits;
+	misses = d.classes[DISK_CLASS_META].misses;
+	if(hits+misses) printf("cache: %ld hits, %ld misses (%.1f%% hit rate)\n",hits,misses,100.0*hits/(hits+misses));
+	stats_print("disk_read",&d.read_latency);
+	stats_print("disk_write",&d.write_latency);
+	stats_print("disk_readv",&d.readv_latency);
+	stats_print("disk_writev",&d.writev_latency);
+
+	disk_close();
+	free(c.runs);
+	free(io);
+	free(blocknums);
+	return 0;
+
+usage:
+	fprintf(stderr,"use: %s [-t] [-b pread|mmap|uring] [-c cache blocks] <trace> <image>\n",argv[0]);
+	fprintf(stderr,"       -t keeps the recorded timing; written blocks are filled with zeros\n");
+	return 1;
+}
@@ -1,228 +1,373 @@
-#include "fs.h"
-#include "disk.h"
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <errno.h>
-#include <string.h>
-
-static int do_copyin( const char *filename, int inumber );
-static int do_copyout( int inumber, const char *filename );
-
-int main( int argc, char *argv[] )
-{
-	char line[1024];
-	char cmd[1024];
-	char arg1[1024];
-	char arg2[1024];
-	int inumber, result, args;
-
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
-		return 1;
-	}
-
-	if(!disk_init(argv[1],atoi(argv[2]))) {
-		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
-		return 1;
-	}
-
-	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size());
-
-	while(1) {
-		printf(" simplefs> ");
-		fflush(stdout);
-
-		if(!fgets(line,sizeof(line),stdin)) break;
-
-		if(line[0]=='\n') continue;
-		line[strlen(line)-1] = 0;
-
-		args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
-		if(args==0) continue;
-
-		if(!strcmp(cmd,"format")) {
-			if(args==1) {
-				if(fs_format()) {
-					printf("disk formatted.\n");
-				} else {
-					printf("format failed!\n");
-				}
-			} else {
-				printf("use: format\n");
-			}
-		} else if(!strcmp(cmd,"mount")) {
-			if(args==1) {
-				if(fs_mount()) {
-					printf("disk mounted.\n");
-				} else {
-					printf("mount failed!\n");
-				}
-			} else {
-				printf("use: mount\n");
-			}
-		} else if(!strcmp(cmd,"debug")) {
-			if(args==1) {
-				fs_debug();
-			} else {
-				printf("use: debug\n");
-			}
-		} else if(!strcmp(cmd,"getsize")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				result = fs_getsize(inumber);
-				if(result>=0) {
-					printf("inode %d has size %d\n",inumber,result);
-				} else {
-					printf("getsize failed!\n");
-				}
-			} else {
-				printf("use: getsize <inumber>\n");
-			}
-			
-		} else if(!strcmp(cmd,"create")) {
-			if(args==1) {
-				inumber = fs_create();
-				/* Bug fixed on April 30th: check for inumber>=0 */
-				if(inumber>=0) {
-					printf("created inode %d\n",inumber);
-				} else {
-					printf("create failed!\n");
-				}
-			} else {
-				printf("use: create\n");
-			}
-		} else if(!strcmp(cmd,"delete")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				if(fs_delete(inumber)) {
-					printf("inode %d deleted.\n",inumber);
-				} else {
-					printf("delete failed!\n");	
-				}
-			} else {
-				printf("use: delete <inumber>\n");
-			}
-		} else if(!strcmp(cmd,"cat")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				if(!do_copyout(inumber,"/dev/stdout")) {
-					printf("cat failed!\n");
-				}
-			} else {
-				printf("use: cat <inumber>\n");
-			}
-
-		} else if(!strcmp(cmd,"copyin")) {
-			if(args==3) {
-				inumber = atoi(arg2);
-				if(do_copyin(arg1,inumber)) {
-					printf("copied file %s to inode %d\n",arg1,inumber);
-				} else {
-					printf("copy failed!\n");
-				}
-			} else {
-				printf("use: copyin <filename> <inumber>\n");
-			}
-
-		} else if(!strcmp(cmd,"copyout")) {
-			if(args==3) {
-				inumber = atoi(arg1);
-				if(do_copyout(inumber,arg2)) {
-					printf("copied inode %d to file %s\n",inumber,arg2);
-				} else {
-					printf("copy failed!\n");
-				}
-			} else {
-				printf("use: copyout <inumber> <filename>\n");
-			}
-
-		} else if(!strcmp(cmd,"help")) {
-			printf("Commands are:\n");
-			printf("    format\n");
-			printf("    mount\n");
-			printf("    debug\n");
-			printf("    create\n");
-			printf("    delete  <inode>\n");
-			printf("    cat     <inode>\n");
-			printf("    copyin  <file> <inode>\n");
-			printf("    copyout <inode> <file>\n");
-			printf("    help\n");
-			printf("    quit\n");
-			printf("    exit\n");
-		} else if(!strcmp(cmd,"quit")) {
-			break;
-		} else if(!strcmp(cmd,"exit")) {
-			break;
-		} else {
-			printf("unknown command: %s\n",cmd);
-			printf("type 'help' for a list of commands.\n");
-			result = 1;
-		}
-	}
-
-	printf("closing emulated disk.\n");
-	disk_close();
-
-	return 0;
-}
-
-static int do_copyin( const char *filename, int inumber )
-{
-	FILE *file;
-	int offset=0, result, actual;
-	char buffer[16384];
-
-	file = fopen(filename,"r");
-	if(!file) {
-		printf("couldn't open %s: %s\n",filename,strerror(errno));
-		return 0;
-	}
-
-	while(1) {
-		result = fread(buffer,1,sizeof(buffer),file);
-		if(result<=0) break;
-		if(result>0) {
-			actual = fs_write(inumber,buffer,result,offset);
-			if(actual<0) {
-				printf("ERROR: fs_write return invalid result %d\n",actual);
-				break;
-			}
-			offset += actual;
-			if(actual!=result) {
-				printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
-				break;
-			}
-		}
-	}
-
-	printf("%d bytes copied\n",offset);
-
-	fclose(file);
-	return 1;
-}
-
-static int do_copyout( int inumber, const char *filename )
-{
-	FILE *file;
-	int offset=0, result;
-	char buffer[16384];
-
-	file = fopen(filename,"w");
-	if(!file) {
-		printf("couldn't open %s: %s\n",filename,strerror(errno));
-		return 0;
-	}
-
-	while(1) {
-		result = fs_read(inumber,buffer,sizeof(buffer),offset);
-		if(result<=0) break;
-		fwrite(buffer,1,result,file);
-		offset += result;
-	}
-
-	printf("%d bytes copied\n",offset);
-
-	fclose(file);
-	return 1;
-}
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+static int do_copyin( const char *filename, int inumber );
+static int do_copyout( int inumber, const char *filename );
+static void do_stats();
+
+int main( int argc, char *argv[] )
+{
+	char line[1024];
+	char cmd[1024];
+	char arg1[1024];
+	char arg2[1024];
+	int inumber, result, args;
+	int mounted = 0;
+	int backend = DISK_BACKEND_PREAD;
+
+	if(argc==4 && !strcmp(argv[3],"mmap")) {
+		backend = DISK_BACKEND_MMAP;
+	} else if((argc==4 || argc==5) && !strcmp(argv[3],"uring")) {
+		backend = DISK_BACKEND_URING;
+		if(argc==5) disk_queue_depth(atoi(argv[4]));
+	} else if(argc!=3) {
+		printf("use: %s <diskfile> <nblocks> [mmap | uring [depth]]\n",argv[0]);
+		return 1;
+	}
+
+	if(!disk_init_backend(argv[1],atoi(argv[2]),backend)) {
+		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
+		return 1;
+	}
+
+	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size());
+
+	while(1) {
+		printf(" simplefs> ");
+		fflush(stdout);
+
+		if(!fgets(line,sizeof(line),stdin)) break;
+
+		if(line[0]=='\n') continue;
+		line[strlen(line)-1] = 0;
+
+		args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
+		if(args==0) continue;
+
+		if(!strcmp(cmd,"format")) {
+			if(args==1 || (args==2 && !strcmp(arg1,"full"))) {
+				if(args==1 ? fs_format() : fs_format_full()) {
+					printf("disk formatted.\n");
+				} else {
+					printf("format failed!\n");
+				}
+			} else {
+				printf("use: format [full]\n");
+			}
+		} else if(!strcmp(cmd,"mount")) {
+			if(args==1) {
+				if(fs_mount()) {
+					printf("disk mounted.\n");
+					mounted = 1;
+				} else {
+					printf("mount failed!\n");
+				}
+			} else {
+				printf("use: mount\n");
+			}
+		} else if(!strcmp(cmd,"unmount")) {
+			if(args==1) {
+				if(fs_unmount()) {
+					printf("disk unmounted.\n");
+					mounted = 0;
+				} else {
+					printf("unmount failed!\n");
+				}
+			} else {
+				printf("use: unmount\n");
+			}
+		} else if(!strcmp(cmd,"sync")) {
+			if(args==1) {
+				if(fs_sync()) {
+					printf("disk synced.\n");
+				} else {
+					printf("sync failed!\n");
+				}
+			} else {
+				printf("use: sync\n");
+			}
+		} else if(!strcmp(cmd,"check")) {
+			if(args==1) {
+				result = fs_check();
+				if(result==0) {
+					printf("no problems found.\n");
+				} else if(result>0) {
+					printf("%d problems found, free block bitmap rebuilt.\n",result);
+				} else {
+					printf("check failed!\n");
+				}
+			} else {
+				printf("use: check\n");
+			}
+		} else if(!strcmp(cmd,"stats")) {
+			if(args==1) {
+				do_stats();
+			} else if(args==2 && !strcmp(arg1,"reset")) {
+				fs_stats_reset();
+				printf("statistics reset.\n");
+			} else {
+				printf("use: stats [reset]\n");
+			}
+		} else if(!strcmp(cmd,"trace")) {
+			if(args==2 && !strcmp(arg1,"stop")) {
+				disk_trace_stop();
+				printf("trace stopped.\n");
+			} else if(args==2) {
+				if(disk_trace_start(arg1)) {
+					printf("tracing block requests to %s.\n",arg1);
+				} else {
+					printf("couldn't open %s: %s\n",arg1,strerror(errno));
+				}
+			} else {
+				printf("use: trace <file> | trace stop\n");
+			}
+		} else if(!strcmp(cmd,"debug")) {
+			if(args==1) {
+				fs_debug();
+			} else {
+				printf("use: debug\n");
+			}
+		} else if(!strcmp(cmd,"getsize")) {
+			if(args==2) {
+				inumber = atoi(arg1);
+				result = fs_getsize(inumber);
+				if(result>=0) {
+					printf("inode %d has size %d\n",inumber,result);
+				} else {
+					printf("getsize failed!\n");
+				}
+			} else {
+				printf("use: getsize <inumber>\n");
+			}
+			
+		} else if(!strcmp(cmd,"create")) {
+			if(args==1 || (args==2 && (!strcmp(arg1,"compressed") || !strcmp(arg1,"dedup")))) {
+				inumber = args==1 ? fs_create() : fs_create_mode(!strcmp(arg1,"dedup") ? FS_CREATE_DEDUP : FS_CREATE_COMPRESSED);
+				/* Bug fixed on April 30th: check for inumber>=0 */
+				if(inumber>=0) {
+					printf("created inode %d\n",inumber);
+				} else {
+					printf("create failed!\n");
+				}
+			} else {
+				printf("use: create [compressed|dedup]\n");
+			}
+		} else if(!strcmp(cmd,"delete")) {
+			if(args==2 || (args==3 && (!strcmp(arg2,"discard") || !strcmp(arg2,"secure")))) {
+				inumber = atoi(arg1);
+				if(args==2) {
+					result = fs_delete(inumber);
+				} else {
+					result = fs_delete_mode(inumber,!strcmp(arg2,"secure") ? FS_DELETE_SECURE : FS_DELETE_DISCARD);
+				}
+				if(result) {
+					printf("inode %d deleted.\n",inumber);
+				} else {
+					printf("delete failed!\n");	
+				}
+			} else {
+				printf("use: delete <inumber> [discard|secure]\n");
+			}
+		} else if(!strcmp(cmd,"cat")) {
+			if(args==2) {
+				inumber = atoi(arg1);
+				if(!do_copyout(inumber,"/dev/stdout")) {
+					printf("cat failed!\n");
+				}
+			} else {
+				printf("use: cat <inumber>\n");
+			}
+
+		} else if(!strcmp(cmd,"copyin")) {
+			if(args==3) {
+				inumber = atoi(arg2);
+				if(do_copyin(arg1,inumber)) {
+					printf("copied file %s to inode %d\n",arg1,inumber);
+				} else {
+					printf("copy failed!\n");
+				}
+			} else {
+				printf("use: copyin <filename> <inumber>\n");
+			}
+
+		} else if(!strcmp(cmd,"copyout")) {
+			if(args==3) {
+				inumber = atoi(arg1);
+				if(do_copyout(inumber,arg2)) {
+					printf("copied inode %d to file %s\n",inumber,arg2);
+				} else {
+					printf("copy failed!\n");
+				}
+			} else {
+				printf("use: copyout <inumber> <filename>\n");
+			}
+
+		} else if(!strcmp(cmd,"help")) {
+			printf("Commands are:\n");
+			printf("    format  [full]\n");
+			printf("    mount\n");
+			printf("    unmount\n");
+			printf("    sync\n");
+			printf("    check\n");
+			printf("    stats   [reset]\n");
+			printf("    trace   <file> | stop\n");
+			printf("    debug\n");
+			printf("    create  [compressed|dedup]\n");
+			printf("    delete  <inode> [discard|secure]\n");
+			printf("    cat     <inode>\n");
+			printf("    copyin  <file> <inode>\n");
+			printf("    copyout <inode> <file>\n");
+			printf("    help\n");
+			printf("    quit\n");
+			printf("    exit\n");
+		} else if(!strcmp(cmd,"quit")) {
+			break;
+		} else if(!strcmp(cmd,"exit")) {
+			break;
+		} else {
+			printf("unknown command: %s\n",cmd);
+			printf("type 'help' for a list of commands.\n");
+			result = 1;
+		}
+	}
+
+	if(mounted) fs_unmount();
+
+	printf("closing emulated disk.\n");
+	disk_close();
+
+	return 0;
+}
+
+static int do_copyin( const char *filename, int inumber )
+{
+	FILE *file;
+	int offset=0, result, actual, fd;
+	char buffer[16384];
+
+	file = fopen(filename,"r");
+	if(!file) {
+		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		return 0;
+	}
+
+	// the inode is checked once here rather than for every chunk
+	fd = fs_open(inumber);
+	if(fd<0) {
+		fclose(file);
+		return 0;
+	}
+
+	while(1) {
+		result = fread(buffer,1,sizeof(buffer),file);
+		if(result<=0) break;
+		if(result>0) {
+			actual = fs_fwrite(fd,buffer,result);
+			if(actual<0) {
+				printf("ERROR: fs_write return invalid result %d\n",actual);
+				break;
+			}
+			offset += actual;
+			if(actual!=result) {
+				printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
+				break;
+			}
+		}
+	}
+
+	printf("%d bytes copied\n",offset);
+
+	fs_close(fd);
+	fclose(file);
+	return 1;
+}
+
+static int do_copyout( int inumber, const char *filename )
+{
+	FILE *file;
+	int offset=0, result, fd, views=1;
+	char buffer[16384];
+	const char *view;
+
+	fd = fs_open(inumber);
+	if(fd<0) return 0;
+
+	file = fopen(filename,"w");
+	if(!file) {
+		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		fs_close(fd);
+		return 0;
+	}
+
+	while(1) {
+		// write straight from the disk mapping when the backend allows it, or read through the handle
+		result = views ? fs_read_view(inumber,offset,&view) : -1;
+		if(result<0) {
+			if(views) fs_seek(fd,offset);
+			views = 0;
+			result = fs_fread(fd,buffer,sizeof(buffer));
+			view = buffer;
+		}
+		if(result<=0) break;
+		fwrite(view,1,result,file);
+		offset += result;
+	}
+
+	printf("%d bytes copied\n",offset);
+
+	fs_close(fd);
+	fclose(file);
+	return 1;
+}
+
+// Print a pair of block counts as one column
+static const char * io_pair( char *buf, long reads, long writes )
+{
+	sprintf(buf,"%ld/%ld",reads,writes);
+	return buf;
+}
+
+static void do_stats()
+{
+	static const char *classes[DISK_CLASSES] = { "metadata", "data", "indirect" };
+	struct fs_op_stats ops[FS_OPS];
+	struct disk_stats d;
+	struct disk_class_stats *c;
+	char meta[32], data[32], indirect[32];
+	long lookups;
+	int i;
+
+	fs_stats(ops);
+	disk_stats(&d);
+
+	printf("%-10s %9s %12s %10s %10s %10s %13s %13s %13s\n","operation","calls","bytes",
+		"avg us","p50 us","p99 us","meta r/w","data r/w","indirect r/w");
+	for(i=0;i<FS_OPS;i++) {
+		if(!ops[i].calls) continue;
+		printf("%-10s %9ld %12ld %10.1f %10.1f %10.1f %13s %13s %13s\n",fs_op_name(i),ops[i].calls,ops[i].bytes,
+			ops[i].nanoseconds/1000.0/ops[i].calls,
+			stats_percentile(&ops[i].latency,50)/1000.0,stats_percentile(&ops[i].latency,99)/1000.0,
+			io_pair(meta,ops[i].io[DISK_CLASS_META].reads,ops[i].io[DISK_CLASS_META].writes),
+			io_pair(data,ops[i].io[DISK_CLASS_DATA].reads,ops[i].io[DISK_CLASS_DATA].writes),
+			io_pair(indirect,ops[i].io[DISK_CLASS_INDIRECT].reads,ops[i].io[DISK_CLASS_INDIRECT].writes));
+	}
+
+	printf("disk blocks:\n");
+	for(i=0;i<DISK_CLASSES;i++) {
+		c = &d.classes[i];
+		lookups = c->hits+c->misses;
+		printf("    %-9s %10ld reads %10ld writes %10ld cache hits %10ld misses",classes[i],c->reads,c->writes,c->hits,c->misses);
+		if(lookups) printf(" (%.1f%% hit rate)",100.0*c->hits/lookups);
+		printf("\n");
+	}
+
+	stats_print("disk_read",&d.read_latency);
+	stats_print("disk_write",&d.write_latency);
+	stats_print("disk_readv",&d.readv_latency);
+	stats_print("disk_writev",&d.writev_latency);
+}
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "stats.h"
+
+// Monotonic clock in nanoseconds
+long stats_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1000000000L+ts.tv_nsec;
+}
+
+void stats_record( struct stats_histogram *h, long ns )
+{
+	int bucket = ns>1 ? 63-__builtin_clzl(ns) : 0;
+
+	if(bucket>=STATS_BUCKETS) bucket = STATS_BUCKETS-1;
+	__atomic_add_fetch(&h->count[bucket],1,__ATOMIC_RELAXED);
+}
+
+// Add the samples of one histogram to another, reading the source atomically
+void stats_add( struct stats_histogram *to, const struct stats_histogram *from )
+{
+	int i;
+
+	for(i=0;i<STATS_BUCKETS;i++) {
+		to->count[i] += __atomic_load_n(&from->count[i],__ATOMIC_RELAXED);
+	}
+}
+
+long stats_samples( const struct stats_histogram *h )
+{
+	long total = 0;
+	int i;
+
+	for(i=0;i<STATS_BUCKETS;i++) total += h->count[i];
+	return total;
+}
+
+// Upper bound in nanoseconds of the bucket holding the given percentile, or 0 without samples
+long stats_percentile( const struct stats_histogram *h, int percent )
+{
+	long total = stats_samples(h);
+	long want = (total*percent+99)/100;
+	long seen = 0;
+	int i;
+
+	if(!total) return 0;
+	if(want<1) want = 1;
+
+	for(i=0;i<STATS_BUCKETS-1;i++) {
+		seen += h->count[i];
+		if(seen>=want) break;
+	}
+	return 2L<<i;
+}
+
+// Print the non-empty buckets of a histogram with a bar scaled to the largest one
+void stats_print( const char *name, const struct stats_histogram *h )
+{
+	long total = stats_samples(h);
+	long most = 0;
+	int i, first = -1, last = 0;
+
+	printf("%s: %ld calls",name,total);
+	if(!total) {
+		printf("\n");
+		return;
+	}
+	printf(", p50 < %.1f us, p99 < %.1f us\n",stats_percentile(h,50)/1000.0,stats_percentile(h,99)/1000.0);
+
+	for(i=0;i<STATS_BUCKETS;i++) {
+		if(!h->count[i]) continue;
+		if(first<0) first = i;
+		last = i;
+		if(h->count[i]>most) most = h->count[i];
+	}
+
+	for(i=first;i<=last;i++) {
+		printf("    %10.1f - %10.1f us %10ld %.*s\n",(1L<<i)/1000.0,(2L<<i)/1000.0,h->count[i],
+			(int)((h->count[i]*40+most-1)/most),"########################################");
+	}
+}
@@ -0,0 +1,24 @@
+#ifndef STATS_H
+#define STATS_H
+
+/*
+Latency histograms with logarithmic buckets.  Bucket i counts the samples
+that took from 2^i up to 2^(i+1) nanoseconds, and the last bucket takes
+everything slower.  Samples are added atomically, so several threads may
+record into one histogram.
+*/
+
+#define STATS_BUCKETS 32
+
+struct stats_histogram {
+	long count[STATS_BUCKETS];
+};
+
+long stats_now();
+void stats_record( struct stats_histogram *h, long ns );
+void stats_add( struct stats_histogram *to, const struct stats_histogram *from );
+long stats_samples( const struct stats_histogram *h );
+long stats_percentile( const struct stats_histogram *h, int percent );
+void stats_print( const char *name, const struct stats_histogram *h );
+
+#endif
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+static int sys_setup( unsigned entries, struct io_uring_params *p )
+{
+	return syscall(__NR_io_uring_setup,entries,p);
+}
+
+static int sys_enter( int fd, unsigned submit, unsigned wait, unsigned flags )
+{
+	return syscall(__NR_io_uring_enter,fd,submit,wait,flags,0,0);
+}
+
+// Set up a ring with room for depth requests.  Returns 0 if io_uring is not available.
+int uring_init( struct uring *r, unsigned depth )
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(r,0,sizeof(*r));
+	memset(&p,0,sizeof(p));
+
+	r->fd = sys_setup(depth,&p);
+	if(r->fd<0) return 0;
+
+	r->depth = p.sq_entries;
+	r->sq_ring_size = p.sq_off.array+p.sq_entries*sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+	r->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+
+	r->sq_ring = mmap(0,r->sq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_SQ_RING);
+	r->cq_ring = mmap(0,r->cq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_CQ_RING);
+	r->sqes = mmap(0,r->sqes_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_SQES);
+	if(r->sq_ring==MAP_FAILED || r->cq_ring==MAP_FAILED || r->sqes==MAP_FAILED) {
+		if(r->sq_ring!=MAP_FAILED) munmap(r->sq_ring,r->sq_ring_size);
+		if(r->cq_ring!=MAP_FAILED) munmap(r->cq_ring,r->cq_ring_size);
+		if(r->sqes!=MAP_FAILED) munmap(r->sqes,r->sqes_size);
+		close(r->fd);
+		r->fd = -1;
+		return 0;
+	}
+
+	sq = r->sq_ring;
+	cq = r->cq_ring;
+	r->sq_head = (unsigned*)(sq+p.sq_off.head);
+	r->sq_tail = (unsigned*)(sq+p.sq_off.tail);
+	r->sq_mask = (unsigned*)(sq+p.sq_off.ring_mask);
+	r->sq_array = (unsigned*)(sq+p.sq_off.array);
+	r->cq_head = (unsigned*)(cq+p.cq_off.head);
+	r->cq_tail = (unsigned*)(cq+p.cq_off.tail);
+	r->cq_mask = (unsigned*)(cq+p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)(cq+p.cq_off.cqes);
+
+	return 1;
+}
+
+// Queue a vectored read or write.  Returns 0 if the submission queue is full.
+int uring_queue( struct uring *r, int write, int fd, struct iovec *iov, int iovcnt, off_t offset, void *tag )
+{
+	unsigned tail = *r->sq_tail;
+	unsigned head = __atomic_load_n(r->sq_head,__ATOMIC_ACQUIRE);
+	unsigned index;
+	struct io_uring_sqe *sqe;
+
+	if(tail-head>=r->depth) return 0;
+
+	index = tail & *r->sq_mask;
+	sqe = &r->sqes[index];
+	memset(sqe,0,sizeof(*sqe));
+	sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)iov;
+	sqe->len = iovcnt;
+	sqe->off = offset;
+	sqe->user_data = (unsigned long)tag;
+
+	r->sq_array[index] = index;
+	__atomic_store_n(r->sq_tail,tail+1,__ATOMIC_RELEASE);
+	r->pending++;
+
+	return 1;
+}
+
+// Hand the queued requests to the kernel, waiting until at least wait of them have completed.
+int uring_submit( struct uring *r, unsigned wait )
+{
+	int result;
+
+	do {
+		result = sys_enter(r->fd,r->pending,wait,wait ? IORING_ENTER_GETEVENTS : 0);
+	} while(result<0 && errno==EINTR);
+
+	if(result<0) return 0;
+
+	r->pending -= result;
+	return 1;
+}
+
+// Collect one completed request, if there is one.
+int uring_reap( struct uring *r, void **tag, int *result )
+{
+	unsigned head = *r->cq_head;
+	struct io_uring_cqe *cqe;
+
+	if(head==__atomic_load_n(r->cq_tail,__ATOMIC_ACQUIRE)) return 0;
+
+	cqe = &r->cqes[head & *r->cq_mask];
+	*tag = (void*)(unsigned long)cqe->user_data;
+	*result = cqe->res;
+
+	__atomic_store_n(r->cq_head,head+1,__ATOMIC_RELEASE);
+	return 1;
+}
+
+void uring_exit( struct uring *r )
+{
+	if(r->fd<0) return;
+
+	munmap(r->sq_ring,r->sq_ring_size);
+	munmap(r->cq_ring,r->cq_ring_size);
+	munmap(r->sqes,r->sqes_size);
+	close(r->fd);
+	r->fd = -1;
+}
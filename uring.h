@@ -0,0 +1,40 @@
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+A minimal io_uring wrapper built directly on the io_uring_setup and
+io_uring_enter system calls, so no extra library is needed.  Requests are
+queued with uring_queue, handed to the kernel with uring_submit, and their
+results collected with uring_reap.
+*/
+
+struct uring {
+	int fd;
+	unsigned depth;
+	unsigned pending;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+int  uring_init( struct uring *r, unsigned depth );
+int  uring_queue( struct uring *r, int write, int fd, struct iovec *iov, int iovcnt, off_t offset, void *tag );
+int  uring_submit( struct uring *r, unsigned wait );
+int  uring_reap( struct uring *r, void **tag, int *result );
+void uring_exit( struct uring *r );
+
+#endif
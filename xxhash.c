@@ -0,0 +1,109 @@
+/*
+
+csci5103_project3
+
+File Systems
+
+Bryan Baker - bake1358@umn.edu
+Alice Anderegg - and08613@umn.edu
+Hailin Archer - deak0007@umn.edu
+
+*/
+
+#include "xxhash.h"
+
+#include <string.h>
+
+#define PRIME1 0x9e3779b185ebca87ULL
+#define PRIME2 0xc2b2ae3d27d4eb4fULL
+#define PRIME3 0x165667b19e3779f9ULL
+#define PRIME4 0x85ebca77c2b2ae63ULL
+#define PRIME5 0x27d4eb2f165667c5ULL
+
+static uint64_t read64( const unsigned char *p )
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t read32( const unsigned char *p )
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t rotl64( uint64_t v, int r )
+{
+	return (v << r) | (v >> (64 - r));
+}
+
+static uint64_t round64( uint64_t acc, uint64_t input )
+{
+	acc += input * PRIME2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME1;
+}
+
+static uint64_t merge64( uint64_t acc, uint64_t lane )
+{
+	acc ^= round64(0, lane);
+	return acc * PRIME1 + PRIME4;
+}
+
+uint64_t xxh64( const void *data, size_t length, uint64_t seed )
+{
+	const unsigned char *p = (const unsigned char *) data;
+	const unsigned char *end = p + length;
+	uint64_t v1, v2, v3, v4;
+	uint64_t h;
+
+	if ( length >= 32 ) {
+		v1 = seed + PRIME1 + PRIME2;
+		v2 = seed + PRIME2;
+		v3 = seed;
+		v4 = seed - PRIME1;
+		while ( p + 32 <= end ) {
+			v1 = round64(v1, read64(p));
+			v2 = round64(v2, read64(p + 8));
+			v3 = round64(v3, read64(p + 16));
+			v4 = round64(v4, read64(p + 24));
+			p += 32;
+		}
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = merge64(h, v1);
+		h = merge64(h, v2);
+		h = merge64(h, v3);
+		h = merge64(h, v4);
+	} else {
+		h = seed + PRIME5;
+	}
+	h += length;
+
+	// the tail that did not fill a stripe
+	while ( p + 8 <= end ) {
+		h ^= round64(0, read64(p));
+		h = rotl64(h, 27) * PRIME1 + PRIME4;
+		p += 8;
+	}
+	if ( p + 4 <= end ) {
+		h ^= (uint64_t) read32(p) * PRIME1;
+		h = rotl64(h, 23) * PRIME2 + PRIME3;
+		p += 4;
+	}
+	while ( p < end ) {
+		h ^= (*p++) * PRIME5;
+		h = rotl64(h, 11) * PRIME1;
+	}
+
+	// mix the bits so every input bit reaches every output bit
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
@@ -0,0 +1,15 @@
+#ifndef XXHASH_H
+#define XXHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+The 64 bit xxHash of a buffer.  It reads the input 32 bytes at a time in four
+independent lanes, so a block hashes at close to memory speed, and gives the
+same values as the reference XXH64.
+*/
+
+uint64_t xxh64( const void *data, size_t length, uint64_t seed );
+
+#endif